@@ -11,7 +11,11 @@ import cffi
 # c_helper.so compiling
 ######################################################################
 
-COMPILE_CMD = ("gcc -Wall -g -O3 -shared -fPIC"
+# Type based alias analysis is disabled as gcc 12 (at -O2 and above)
+# may keep a list head cached in a register across list_del() calls on
+# its nodes, which turns the moveq junction point loops into infinite
+# loops.
+COMPILE_CMD = ("gcc -Wall -g -O3 -shared -fPIC -fno-strict-aliasing"
                " -flto -fwhole-program -fno-use-linker-plugin"
                " -o %s %s")
 SOURCE_FILES = [
@@ -19,20 +23,24 @@ SOURCE_FILES = [
     'accelcombine.c', 'accelgroup.c', 'moveq.c', 'scurve.c', 'trapbuild.c',
     'kin_cartesian.c', 'kin_corexy.c', 'kin_delta.c', 'kin_polar.c',
     'kin_rotary_delta.c', 'kin_winch.c', 'kin_extruder.c', 'kin_smooth_axis.c',
-    'integrate.c',
+    'integrate.c', 'stepgen.c', 'mempool.c',
 ]
 DEST_LIB = "c_helper.so"
 OTHER_FILES = [
     'list.h', 'serialqueue.h', 'stepcompress.h', 'integrate.h', 'itersolve.h',
     'accelcombine.h', 'accelgroup.h', 'moveq.h', 'scurve.h', 'trapbuild.h',
-    'pyhelper.h', 'trapq.h'
+    'pyhelper.h', 'trapq.h', 'stepgen.h', 'mempool.h'
 ]
 
 defs_stepcompress = """
     struct stepcompress *stepcompress_alloc(uint32_t oid);
     void stepcompress_fill(struct stepcompress *sc, uint32_t max_error
         , uint32_t invert_sdir, uint32_t queue_step_msgid
-        , uint32_t set_next_step_dir_msgid);
+        , uint32_t set_next_step_dir_msgid, uint32_t compress_mode);
+    void stepcompress_set_add2(struct stepcompress *sc
+        , uint32_t queue_step_add2_msgid);
+    int stepcompress_add_mirror(struct stepcompress *sc, uint32_t oid
+        , uint32_t invert_sdir);
     void stepcompress_free(struct stepcompress *sc);
     int stepcompress_reset(struct stepcompress *sc, uint64_t last_step_clock);
     int stepcompress_queue_msg(struct stepcompress *sc
@@ -43,7 +51,13 @@ defs_stepcompress = """
     void steppersync_free(struct steppersync *ss);
     void steppersync_set_time(struct steppersync *ss
         , double time_offset, double mcu_freq);
+    int steppersync_set_compress_threads(struct steppersync *ss
+        , int num_threads);
+    void steppersync_set_queue_steps(struct steppersync *ss
+        , uint32_t queue_step_msgid, uint32_t queue_steps_msgid);
     int steppersync_flush(struct steppersync *ss, uint64_t move_clock);
+    struct command_queue *steppersync_get_commandqueue(
+        struct steppersync *ss);
 """
 
 defs_itersolve = """
@@ -62,6 +76,13 @@ defs_itersolve = """
     double itersolve_get_commanded_pos(struct stepper_kinematics *sk);
 """
 
+defs_stepgen = """
+    struct stepgen_batch *stepgen_batch_alloc(int num_threads);
+    void stepgen_batch_free(struct stepgen_batch *sgb);
+    int32_t stepgen_batch_generate(struct stepgen_batch *sgb
+        , struct stepper_kinematics **sks, int count, double flush_time);
+"""
+
 defs_moveq = """
     struct move_accel_decel {
         double accel_t, accel_offset_t, total_accel_t;
@@ -74,7 +95,9 @@ defs_moveq = """
     struct move_accel_decel *move_accel_decel_alloc(void);
 
     struct moveq *moveq_alloc(void);
+    void moveq_free(struct moveq *mq);
     void moveq_reset(struct moveq *mq);
+    void moveq_get_stats(struct moveq *mq, char *buf, int len);
     int moveq_add(struct moveq *mq, double move_d
         , double junction_max_v2, double max_cruise_v2
         , int accel_order, double accel, double smoothed_accel
@@ -96,6 +119,7 @@ defs_trapq = """
     struct trapq *trapq_alloc(void);
     void trapq_free(struct trapq *tq);
     void trapq_free_moves(struct trapq *tq, double print_time);
+    void trapq_get_stats(struct trapq *tq, char *buf, int len);
 """
 
 defs_kin_cartesian = """
@@ -145,15 +169,30 @@ defs_kin_smooth_axis = """
 """
 
 defs_serialqueue = """
-    #define MESSAGE_MAX 64
+    #define MESSAGE_BLOCK_MAX 255
     struct pull_queue_message {
-        uint8_t msg[MESSAGE_MAX];
+        uint8_t msg[MESSAGE_BLOCK_MAX];
         int len;
         double sent_time, receive_time;
         uint64_t notify_id;
     };
+    #define SQ_HIST_SIZE 20
+    struct sq_histogram {
+        uint32_t count;
+        double sum;
+        uint32_t buckets[SQ_HIST_SIZE];
+    };
+    struct command_queue_stats {
+        uint32_t bytes, stalled_bytes;
+        struct sq_histogram queue_time;
+    };
+    struct serialqueue_stats {
+        uint32_t retransmits, ready_bytes, stalled_bytes;
+        struct sq_histogram ack_time;
+    };
 
-    struct serialqueue *serialqueue_alloc(int serial_fd, int write_only);
+    struct serialqueue *serialqueue_alloc(int serial_fd, char serial_fd_type
+        , int write_only);
     void serialqueue_exit(struct serialqueue *sq);
     void serialqueue_free(struct serialqueue *sq);
     struct command_queue *serialqueue_alloc_commandqueue(void);
@@ -167,9 +206,14 @@ defs_serialqueue = """
         , double baud_adjust);
     void serialqueue_set_receive_window(struct serialqueue *sq
         , int receive_window);
+    void serialqueue_set_block_max(struct serialqueue *sq, int block_max);
     void serialqueue_set_clock_est(struct serialqueue *sq, double est_freq
         , double last_clock_time, uint64_t last_clock);
     void serialqueue_get_stats(struct serialqueue *sq, char *buf, int len);
+    void serialqueue_get_queue_stats(struct serialqueue *sq
+        , struct command_queue *cq, struct command_queue_stats *stats);
+    void serialqueue_get_timing_stats(struct serialqueue *sq
+        , struct serialqueue_stats *stats);
     int serialqueue_extract_old(struct serialqueue *sq, int sentq
         , struct pull_queue_message *q, int max);
 """
@@ -185,7 +229,7 @@ defs_std = """
 
 defs_all = [
     defs_pyhelper, defs_serialqueue, defs_std,
-    defs_stepcompress, defs_itersolve, defs_moveq, defs_trapq,
+    defs_stepcompress, defs_itersolve, defs_stepgen, defs_moveq, defs_trapq,
     defs_kin_cartesian, defs_kin_corexy, defs_kin_delta, defs_kin_polar,
     defs_kin_rotary_delta, defs_kin_winch, defs_kin_extruder,
     defs_kin_smooth_axis,
@@ -241,6 +285,25 @@ def get_ffi():
     return FFI_main, FFI_lib
 
 
+######################################################################
+# Motion pipeline benchmark
+######################################################################
+
+BENCH_COMPILE_CMD = ("gcc -Wall -g -O3 -fno-strict-aliasing"
+                     " -flto -fwhole-program -fno-use-linker-plugin"
+                     " -o %s %s -lm -lpthread")
+BENCH_SOURCE_FILES = SOURCE_FILES + ['benchmark.c']
+BENCH_TARGET = "c_helper_bench"
+
+# Build the standalone benchmark and run it with the given arguments
+def run_benchmark(args):
+    srcdir = os.path.dirname(os.path.realpath(__file__))
+    check_build_code(srcdir, BENCH_TARGET, BENCH_SOURCE_FILES,
+                     BENCH_COMPILE_CMD, OTHER_FILES)
+    cmd = [os.path.join(srcdir, BENCH_TARGET)] + list(args)
+    return os.system(' '.join(["'%s'" % (a,) for a in cmd]))
+
+
 ######################################################################
 # hub-ctrl hub power controller
 ######################################################################
@@ -259,4 +322,7 @@ def run_hub_ctrl(enable_power):
 
 
 if __name__ == '__main__':
+    import sys
+    if sys.argv[1:2] == ['benchmark']:
+        sys.exit(run_benchmark(sys.argv[2:]) and 1)
     get_ffi()
@@ -0,0 +1,864 @@
+// Standalone benchmark of the host motion pipeline
+//
+// Copyright (C) 2020  Kevin O'Connor <kevin@koconnor.net>
+//
+// This file may be distributed under the terms of the GNU GPLv3 license.
+
+// This program replays a stream of moves (either parsed from a g-code
+// file or synthetically generated) through the same C code that
+// klippy uses at runtime: moveq_add/moveq_plan, trapq_append,
+// itersolve_generate_steps, and steppersync_flush.  The generated
+// mcu commands are written to a temporary file via a write-only
+// serialqueue and are then decoded to report the number of steps and
+// queue_step messages.  Each kinematic configuration is run in a
+// separate process so that the reported peak memory usage is
+// accurate.
+
+#include <getopt.h> // getopt_long
+#include <math.h> // sqrt
+#include <stdint.h> // uint64_t
+#include <stdio.h> // printf
+#include <stdlib.h> // malloc
+#include <string.h> // memset
+#include <sys/mman.h> // mmap
+#include <sys/resource.h> // getrusage
+#include <sys/stat.h> // fstat
+#include <sys/wait.h> // waitpid
+#include <unistd.h> // fork
+#include "compiler.h" // ARRAY_SIZE
+#include "itersolve.h" // itersolve_set_position
+#include "moveq.h" // moveq_add
+#include "pyhelper.h" // get_monotonic
+#include "serialqueue.h" // serialqueue_alloc
+#include "stepcompress.h" // stepcompress_alloc
+#include "stepgen.h" // stepgen_batch_generate
+#include "trapq.h" // trapq_append
+
+// Stepper kinematics allocation functions (from kin_*.c)
+struct stepper_kinematics *cartesian_stepper_alloc(char axis);
+struct stepper_kinematics *corexy_stepper_alloc(char type);
+struct stepper_kinematics *delta_stepper_alloc(double arm2, double tower_x
+                                               , double tower_y);
+struct stepper_kinematics *polar_stepper_alloc(char type);
+struct stepper_kinematics *rotary_delta_stepper_alloc(
+    double shoulder_radius, double shoulder_height
+    , double angle, double upper_arm, double lower_arm);
+struct stepper_kinematics *winch_stepper_alloc(double anchor_x
+                                               , double anchor_y
+                                               , double anchor_z);
+struct stepper_kinematics *extruder_stepper_alloc(void);
+void extruder_set_smooth_time(struct stepper_kinematics *sk
+                              , double smooth_time);
+struct stepper_kinematics *smooth_axis_alloc(void);
+void smooth_axis_set_time(struct stepper_kinematics *sk
+                          , double smooth_x, double smooth_y);
+int smooth_axis_set_sk(struct stepper_kinematics *sk
+                       , struct stepper_kinematics *orig_sk);
+
+
+/****************************************************************
+ * Benchmark settings
+ ****************************************************************/
+
+struct bench_config {
+    int accel_order, synth_moves;
+    double max_velocity, max_accel, accel_to_decel, square_corner_velocity;
+    double jerk, min_jerk_limit_time;
+    double step_dist, mcu_freq, max_error;
+    double pressure_advance, pa_smooth_time, smooth_time;
+    int move_num, threads, compress_threads, compress_mode, add2;
+    const char *kinematics, *gcode_file;
+};
+
+static struct bench_config bc = {
+    .accel_order = 2, .synth_moves = 100000,
+    .max_velocity = 300., .max_accel = 3000., .square_corner_velocity = 5.,
+    .step_dist = .0125, .mcu_freq = 72000000., .max_error = .000025,
+    .pa_smooth_time = .040, .move_num = 1024, .threads = 1,
+    .kinematics = "all",
+};
+
+// Values used to emulate toolhead.py step generation timing
+#define BUFFER_TIME_START 0.250
+// Start well after time zero as the mcu print_time would in klippy
+#define BENCH_START_TIME 2.000
+#define LOOKAHEAD_FLUSH_TIME 0.250
+#define MOVE_BATCH_TIME 0.500
+#define SDS_CHECK_TIME 0.001
+#define MOVE_FLUSH_TIME 0.050
+#define NEVER_JERK 9999999999999999.9
+
+// Message ids used in the generated mcu commands
+#define BENCH_QUEUE_STEP_MSGID 1
+#define BENCH_SET_NEXT_STEP_DIR_MSGID 2
+#define BENCH_QUEUE_STEP_ADD2_MSGID 3
+
+
+/****************************************************************
+ * Move stream generation
+ ****************************************************************/
+
+struct bench_gmove {
+    double pos[4], speed;
+};
+
+struct bench_moves {
+    struct bench_gmove *moves;
+    int count, alloc;
+};
+
+static void
+moves_add(struct bench_moves *bm, double *pos, double speed)
+{
+    if (bm->count >= bm->alloc) {
+        bm->alloc = bm->alloc ? bm->alloc * 2 : 1024;
+        bm->moves = realloc(bm->moves, bm->alloc * sizeof(*bm->moves));
+    }
+    struct bench_gmove *gm = &bm->moves[bm->count++];
+    memcpy(gm->pos, pos, sizeof(gm->pos));
+    gm->speed = speed;
+}
+
+// Generate small arc-like segments (similar to gcode_arcs and
+// bed_mesh output) with periodic travel and z moves
+static void
+moves_synthetic(struct bench_moves *bm, int count)
+{
+    double pos[4] = { 40., 0., 1., 0. };
+    moves_add(bm, pos, bc.max_velocity);
+    int i;
+    for (i=0; i<count; i++) {
+        if (i % 1000 == 999) {
+            // Layer change
+            pos[2] += .2;
+            moves_add(bm, pos, 10.);
+            continue;
+        }
+        double radius = 40. - 10. * ((i / 200) % 3);
+        double angle = i * 2. * M_PI / 200.;
+        double nx = radius * cos(angle), ny = radius * sin(angle);
+        double dx = nx - pos[0], dy = ny - pos[1];
+        pos[0] = nx;
+        pos[1] = ny;
+        pos[3] += .05 * sqrt(dx*dx + dy*dy);
+        moves_add(bm, pos, i % 200 < 5 ? bc.max_velocity : 100.);
+    }
+}
+
+// Parse a simple g-code file (G0/G1 moves and positioning modes)
+static int
+moves_parse_gcode(struct bench_moves *bm, const char *filename)
+{
+    FILE *f = fopen(filename, "r");
+    if (!f) {
+        perror(filename);
+        return -1;
+    }
+    double pos[4] = { 0., 0., 0., 0. }, base[4] = { 0., 0., 0., 0. };
+    double speed = 25.;
+    int absolute_coord = 1, absolute_extrude = 1;
+    char line[1024];
+    while (fgets(line, sizeof(line), f)) {
+        char *comment = strchr(line, ';');
+        if (comment)
+            *comment = '\0';
+        char *p = line, *end;
+        while (*p == ' ' || *p == '\t')
+            p++;
+        char cmd = *p & ~0x20;
+        if (cmd != 'G' && cmd != 'M')
+            continue;
+        int num = strtol(p+1, &end, 10);
+        if (end == p+1)
+            continue;
+        if (cmd == 'M') {
+            if (num == 82 || num == 83)
+                absolute_extrude = num == 82;
+            continue;
+        }
+        if (num == 90 || num == 91) {
+            absolute_coord = absolute_extrude = num == 90;
+            continue;
+        }
+        if (num != 0 && num != 1 && num != 92)
+            continue;
+        double newpos[4];
+        memcpy(newpos, pos, sizeof(newpos));
+        for (p = end; *p; p++) {
+            char param = *p & ~0x20;
+            const char *axes = "XYZE", *a = strchr(axes, param);
+            if (!a && param != 'F')
+                continue;
+            double v = strtod(p+1, &end);
+            if (end == p+1)
+                continue;
+            p = end - 1;
+            if (param == 'F') {
+                if (v > 0.)
+                    speed = v / 60.;
+                continue;
+            }
+            int axis = a - axes;
+            if (num == 92)
+                base[axis] = pos[axis] - v;
+            else if (axis < 3 ? absolute_coord : absolute_extrude)
+                newpos[axis] = v + base[axis];
+            else
+                newpos[axis] += v;
+        }
+        if (num == 92)
+            continue;
+        memcpy(pos, newpos, sizeof(pos));
+        moves_add(bm, pos, speed);
+    }
+    fclose(f);
+    return 0;
+}
+
+
+/****************************************************************
+ * Kinematic configurations
+ ****************************************************************/
+
+#define MAX_STEPPERS 8
+
+struct bench_kin {
+    const char *name;
+    int num_steppers, can_smooth;
+    struct stepper_kinematics *(*alloc)(int idx, double *step_dist);
+};
+
+static struct stepper_kinematics *
+alloc_cartesian(int idx, double *step_dist)
+{
+    return cartesian_stepper_alloc("xyz"[idx]);
+}
+
+static struct stepper_kinematics *
+alloc_corexy(int idx, double *step_dist)
+{
+    if (idx == 2)
+        return cartesian_stepper_alloc('z');
+    return corexy_stepper_alloc("+-"[idx]);
+}
+
+static struct stepper_kinematics *
+alloc_delta(int idx, double *step_dist)
+{
+    double angle = (210. + 120. * idx) * M_PI / 180., radius = 140.;
+    double arm = 300.;
+    return delta_stepper_alloc(arm * arm, cos(angle) * radius
+                               , sin(angle) * radius);
+}
+
+static struct stepper_kinematics *
+alloc_polar(int idx, double *step_dist)
+{
+    if (idx == 2)
+        return cartesian_stepper_alloc('z');
+    if (idx == 0)
+        return polar_stepper_alloc('r');
+    // Bed rotation is in radians
+    *step_dist = *step_dist / 40.;
+    return polar_stepper_alloc('a');
+}
+
+static struct stepper_kinematics *
+alloc_rotary_delta(int idx, double *step_dist)
+{
+    // Arm rotation is in radians
+    *step_dist = *step_dist / 100.;
+    double angle = (30. + 120. * idx) * M_PI / 180.;
+    return rotary_delta_stepper_alloc(33.9, 412.9, angle, 170., 320.);
+}
+
+static struct stepper_kinematics *
+alloc_winch(int idx, double *step_dist)
+{
+    static const double anchors[][3] = {
+        { 0., 300., 600. }, { 260., -150., 600. }, { -260., -150., 600. },
+        { 0., 0., 650. },
+    };
+    const double *a = anchors[idx];
+    return winch_stepper_alloc(a[0], a[1], a[2]);
+}
+
+static const struct bench_kin bench_kins[] = {
+    { "cartesian", 3, 1, alloc_cartesian },
+    { "corexy", 3, 1, alloc_corexy },
+    { "delta", 3, 1, alloc_delta },
+    // The polar angle unwrapping relies on the stepper's commanded_pos
+    // and thus can't be wrapped by smooth_axis
+    { "polar", 3, 0, alloc_polar },
+    { "rotary_delta", 3, 1, alloc_rotary_delta },
+    { "winch", 4, 1, alloc_winch },
+};
+
+
+/****************************************************************
+ * Pipeline emulation
+ ****************************************************************/
+
+struct bench_stepper {
+    struct stepper_kinematics *sk, *orig_sk;
+    struct stepcompress *sc;
+};
+
+struct bench_state {
+    struct bench_moves *bm;
+    int pending_pos;
+    struct moveq *mq;
+    struct move_accel_decel accel_decel;
+    struct trapq *tq, *extruder_tq;
+    struct bench_stepper steppers[MAX_STEPPERS];
+    struct stepper_kinematics *sks[MAX_STEPPERS];
+    int num_steppers;
+    struct stepgen_batch *sgb;
+    struct serialqueue *sq;
+    struct steppersync *ss;
+    double print_time, kin_flush_delay, last_flush_time, junction_flush;
+    double junction_deviation;
+    double plan_time, gen_time, flush_time;
+    int flushed_moves;
+};
+
+struct bench_pmove {
+    double axes_d[4], axes_r[4], move_d;
+    double accel, accel_to_decel, max_cruise_v2, min_move_t;
+    int is_kinematic;
+};
+
+// Calculate move parameters (see toolhead.py:Move)
+static void
+fill_pmove(struct bench_pmove *pm, const double *start, const double *end
+           , double speed)
+{
+    memset(pm, 0, sizeof(*pm));
+    double velocity = speed < bc.max_velocity ? speed : bc.max_velocity;
+    int i;
+    for (i=0; i<4; i++)
+        pm->axes_d[i] = end[i] - start[i];
+    double *ad = pm->axes_d;
+    pm->move_d = sqrt(ad[0]*ad[0] + ad[1]*ad[1] + ad[2]*ad[2]);
+    pm->accel = bc.max_accel;
+    pm->accel_to_decel = bc.accel_to_decel;
+    pm->is_kinematic = 1;
+    if (pm->move_d < .000000001) {
+        // Extrude only move
+        ad[0] = ad[1] = ad[2] = 0.;
+        pm->move_d = fabs(ad[3]);
+        pm->accel = pm->accel_to_decel = 99999999.9;
+        velocity = speed;
+        pm->is_kinematic = 0;
+    }
+    double inv_move_d = pm->move_d ? 1. / pm->move_d : 0.;
+    for (i=0; i<4; i++)
+        pm->axes_r[i] = ad[i] * inv_move_d;
+    pm->max_cruise_v2 = velocity * velocity;
+    pm->min_move_t = pm->move_d / velocity;
+}
+
+// Calculate the maximum junction velocity (see toolhead.py:calc_junction)
+static double
+calc_junction(struct bench_state *bs, const struct bench_pmove *pm
+              , const struct bench_pmove *prev)
+{
+    if (!pm->is_kinematic || !prev->is_kinematic)
+        return 0.;
+    double junction_cos_theta = -(pm->axes_r[0] * prev->axes_r[0]
+                                  + pm->axes_r[1] * prev->axes_r[1]
+                                  + pm->axes_r[2] * prev->axes_r[2]);
+    if (junction_cos_theta > 0.999999)
+        return 0.;
+    if (junction_cos_theta < -0.999999)
+        junction_cos_theta = -0.999999;
+    double sin_theta_d2 = sqrt(0.5*(1.0-junction_cos_theta));
+    double R = bs->junction_deviation * sin_theta_d2 / (1. - sin_theta_d2);
+    double tan_theta_d2 = sin_theta_d2 / sqrt(0.5*(1.0+junction_cos_theta));
+    double move_centripetal_v2 = .5 * pm->move_d * tan_theta_d2 * pm->accel;
+    double prev_centripetal_v2 = (.5 * prev->move_d * tan_theta_d2
+                                  * prev->accel);
+    double v2 = MIN(R * pm->accel, R * prev->accel);
+    v2 = MIN(v2, MIN(move_centripetal_v2, prev_centripetal_v2));
+    return MIN(v2, MIN(pm->max_cruise_v2, prev->max_cruise_v2));
+}
+
+// Generate steps and transmit them (see toolhead.py:_update_move_time)
+static int
+update_move_time(struct bench_state *bs, double next_print_time)
+{
+    for (;;) {
+        double start = get_monotonic();
+        bs->print_time = MIN(bs->print_time + MOVE_BATCH_TIME
+                             , next_print_time);
+        double sg_flush_time = MAX(bs->last_flush_time
+                                   , bs->print_time - bs->kin_flush_delay);
+        int32_t ret = stepgen_batch_generate(bs->sgb, bs->sks, bs->num_steppers
+                                             , sg_flush_time);
+        if (ret)
+            return ret;
+        double free_time = MAX(bs->last_flush_time
+                               , sg_flush_time - bs->kin_flush_delay);
+        trapq_free_moves(bs->tq, free_time);
+        trapq_free_moves(bs->extruder_tq, free_time);
+        double end = get_monotonic();
+        bs->gen_time += end - start;
+        double mcu_flush_time = MAX(bs->last_flush_time
+                                    , sg_flush_time - MOVE_FLUSH_TIME);
+        ret = steppersync_flush(bs->ss, mcu_flush_time * bc.mcu_freq);
+        if (ret)
+            return ret;
+        bs->flush_time += get_monotonic() - end;
+        if (bs->print_time >= next_print_time)
+            return 0;
+    }
+}
+
+// Add planned moves to the trapq and generate their steps
+static int
+process_moves(struct bench_state *bs, int flush_count)
+{
+    struct move_accel_decel *ad = &bs->accel_decel;
+    double next_move_time = bs->print_time;
+    int i;
+    for (i=0; i<flush_count; i++) {
+        double start = get_monotonic();
+        int ret = moveq_getmove(bs->mq, ad);
+        bs->plan_time += get_monotonic() - start;
+        if (ret)
+            return ret;
+        struct bench_gmove *gm = &bs->bm->moves[bs->pending_pos];
+        struct bench_pmove pm;
+        fill_pmove(&pm, gm[-1].pos, gm->pos, gm->speed);
+        bs->pending_pos++;
+        if (pm.is_kinematic)
+            trapq_append(bs->tq, next_move_time, ad->accel_order
+                         , ad->accel_t, ad->accel_offset_t, ad->total_accel_t
+                         , ad->cruise_t
+                         , ad->decel_t, ad->decel_offset_t, ad->total_decel_t
+                         , gm[-1].pos[0], gm[-1].pos[1], gm[-1].pos[2]
+                         , pm.axes_r[0], pm.axes_r[1], pm.axes_r[2]
+                         , ad->start_accel_v, ad->cruise_v
+                         , ad->effective_accel, ad->effective_decel);
+        if (pm.axes_d[3]) {
+            double pa = 0.;
+            if (pm.axes_r[3] > 0. && (pm.axes_d[0] || pm.axes_d[1]))
+                pa = bc.pressure_advance;
+            trapq_append(bs->extruder_tq, next_move_time, ad->accel_order
+                         , ad->accel_t, ad->accel_offset_t, ad->total_accel_t
+                         , ad->cruise_t
+                         , ad->decel_t, ad->decel_offset_t, ad->total_decel_t
+                         , gm[-1].pos[3], 0., 0.
+                         , pm.axes_r[3], pa, 0.
+                         , ad->start_accel_v, ad->cruise_v
+                         , ad->effective_accel, ad->effective_decel);
+        }
+        next_move_time += ad->accel_t + ad->cruise_t + ad->decel_t;
+    }
+    bs->flushed_moves += flush_count;
+    return update_move_time(bs, next_move_time);
+}
+
+// Run the look-ahead planner (see extras/scurve.py:flush)
+static int
+flush_lookahead(struct bench_state *bs, int lazy)
+{
+    bs->junction_flush = LOOKAHEAD_FLUSH_TIME;
+    double start = get_monotonic();
+    int flush_count = moveq_plan(bs->mq, lazy);
+    bs->plan_time += get_monotonic() - start;
+    if (flush_count < 0)
+        return flush_count;
+    if (!flush_count)
+        return 0;
+    return process_moves(bs, flush_count);
+}
+
+// Queue all moves into the look-ahead planner
+static int
+queue_moves(struct bench_state *bs)
+{
+    struct bench_moves *bm = bs->bm;
+    struct bench_pmove prev, pm;
+    memset(&prev, 0, sizeof(prev));
+    int i;
+    for (i=1; i<bm->count; i++) {
+        struct bench_gmove *gm = &bm->moves[i];
+        fill_pmove(&pm, gm[-1].pos, gm->pos, gm->speed);
+        if (!pm.move_d) {
+            // Null move - remove it from the stream
+            memmove(gm, gm+1, (bm->count - i - 1) * sizeof(*gm));
+            bm->count--;
+            i--;
+            continue;
+        }
+        double junction_max_v2 = i > 1 ? calc_junction(bs, &pm, &prev) : 0.;
+        double jerk = pm.is_kinematic ? bc.jerk : NEVER_JERK;
+        double start = get_monotonic();
+        int ret = moveq_add(bs->mq, pm.move_d, junction_max_v2
+                            , pm.max_cruise_v2, bc.accel_order, pm.accel
+                            , pm.accel_to_decel, jerk
+                            , bc.min_jerk_limit_time);
+        bs->plan_time += get_monotonic() - start;
+        if (ret)
+            return ret;
+        prev = pm;
+        bs->junction_flush -= pm.min_move_t;
+        if (bs->junction_flush <= 0.) {
+            ret = flush_lookahead(bs, 1);
+            if (ret)
+                return ret;
+        }
+    }
+    int ret = flush_lookahead(bs, 0);
+    if (ret)
+        return ret;
+    // Flush all remaining steps (see toolhead.py:flush_step_generation)
+    ret = update_move_time(bs, bs->print_time + bs->kin_flush_delay);
+    if (ret)
+        return ret;
+    return steppersync_flush(bs->ss, UINT64_MAX >> 2);
+}
+
+// Wait for the serialqueue background thread to write all data
+static void
+wait_serialqueue(struct serialqueue *sq)
+{
+    for (;;) {
+        char buf[512];
+        serialqueue_get_stats(sq, buf, sizeof(buf));
+        unsigned int ready_bytes = 1, stalled_bytes = 1;
+        char *p = strstr(buf, "ready_bytes=");
+        if (p)
+            sscanf(p, "ready_bytes=%u stalled_bytes=%u"
+                   , &ready_bytes, &stalled_bytes);
+        if (!ready_bytes && !stalled_bytes)
+            return;
+        usleep(1000);
+    }
+}
+
+struct bench_output {
+    uint64_t steps, queue_step_msgs, add2_msgs, dir_msgs, bytes;
+};
+
+// Decode a vlq encoded integer (see src/command.c:parse_int)
+static uint32_t
+parse_int(uint8_t **pp)
+{
+    uint8_t *p = *pp, c = *p++;
+    uint32_t v = c & 0x7f;
+    if ((c & 0x60) == 0x60)
+        v |= -0x20;
+    while (c & 0x80) {
+        c = *p++;
+        v = (v<<7) | (c & 0x7f);
+    }
+    *pp = p;
+    return v;
+}
+
+// Decode the mcu commands written to the output file
+static int
+decode_output(int fd, struct bench_output *bo)
+{
+    memset(bo, 0, sizeof(*bo));
+    struct stat st;
+    int ret = fstat(fd, &st);
+    if (ret || !st.st_size)
+        return ret;
+    uint8_t *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED)
+        return -1;
+    uint8_t *p = data, *end = data + st.st_size;
+    while (p + MESSAGE_MIN <= end) {
+        uint8_t *msgend = p + p[MESSAGE_POS_LEN] - MESSAGE_TRAILER_SIZE;
+        uint8_t *c = p + MESSAGE_HEADER_SIZE;
+        while (c < msgend) {
+            uint32_t msgid = parse_int(&c);
+            if (msgid == BENCH_QUEUE_STEP_MSGID) {
+                parse_int(&c);
+                parse_int(&c);
+                bo->steps += (uint16_t)parse_int(&c);
+                parse_int(&c);
+                bo->queue_step_msgs++;
+            } else if (msgid == BENCH_QUEUE_STEP_ADD2_MSGID) {
+                parse_int(&c);
+                parse_int(&c);
+                bo->steps += (uint16_t)parse_int(&c);
+                parse_int(&c);
+                parse_int(&c);
+                bo->queue_step_msgs++;
+                bo->add2_msgs++;
+            } else if (msgid == BENCH_SET_NEXT_STEP_DIR_MSGID) {
+                parse_int(&c);
+                parse_int(&c);
+                bo->dir_msgs++;
+            } else {
+                fprintf(stderr, "Unknown message id %u\n", msgid);
+                break;
+            }
+        }
+        p = msgend + MESSAGE_TRAILER_SIZE;
+    }
+    bo->bytes = st.st_size;
+    munmap(data, st.st_size);
+    return 0;
+}
+
+// Setup a stepper and its stepcompress object
+static void
+setup_stepper(struct bench_state *bs, struct stepper_kinematics *sk
+              , struct trapq *tq, double step_dist, double smooth_time)
+{
+    struct bench_stepper *s = &bs->steppers[bs->num_steppers];
+    s->sc = stepcompress_alloc(bs->num_steppers);
+    stepcompress_fill(s->sc, bc.max_error * bc.mcu_freq, 0
+                      , BENCH_QUEUE_STEP_MSGID, BENCH_SET_NEXT_STEP_DIR_MSGID
+                      , bc.compress_mode);
+    if (bc.add2)
+        stepcompress_set_add2(s->sc, BENCH_QUEUE_STEP_ADD2_MSGID);
+    s->sk = sk;
+    if (smooth_time && sk->active_flags & (AF_X | AF_Y)) {
+        // Wrap the stepper with the smooth_axis kinematic filter
+        s->orig_sk = sk;
+        s->sk = smooth_axis_alloc();
+        smooth_axis_set_sk(s->sk, sk);
+        smooth_axis_set_time(s->sk, smooth_time, smooth_time);
+    }
+    itersolve_set_trapq(s->sk, tq);
+    itersolve_set_stepcompress(s->sk, s->sc, step_dist);
+    bs->sks[bs->num_steppers] = s->sk;
+    if (s->sk->gen_steps_pre_active + SDS_CHECK_TIME > bs->kin_flush_delay)
+        bs->kin_flush_delay = s->sk->gen_steps_pre_active + SDS_CHECK_TIME;
+    bs->num_steppers++;
+}
+
+// Run the full pipeline for one kinematic configuration
+static int
+run_kinematics(const struct bench_kin *bk, struct bench_moves *bm)
+{
+    struct bench_state bs;
+    memset(&bs, 0, sizeof(bs));
+    bs.bm = bm;
+    bs.pending_pos = 1;
+    bs.print_time = bs.last_flush_time = BENCH_START_TIME + BUFFER_TIME_START;
+    bs.kin_flush_delay = SDS_CHECK_TIME;
+    bs.junction_flush = LOOKAHEAD_FLUSH_TIME;
+    double scv = bc.square_corner_velocity;
+    bs.junction_deviation = scv * scv * (sqrt(2.) - 1.) / bc.max_accel;
+    bs.mq = moveq_alloc();
+    bs.tq = trapq_alloc();
+    bs.extruder_tq = trapq_alloc();
+
+    // Setup steppers
+    double *start_pos = bm->moves[0].pos;
+    int i;
+    for (i=0; i<bk->num_steppers; i++) {
+        double step_dist = bc.step_dist;
+        struct stepper_kinematics *sk = bk->alloc(i, &step_dist);
+        setup_stepper(&bs, sk, bs.tq, step_dist
+                      , bk->can_smooth ? bc.smooth_time : 0.);
+        itersolve_set_position(sk, start_pos[0], start_pos[1], start_pos[2]);
+        if (bs.steppers[i].orig_sk)
+            itersolve_set_position(bs.steppers[i].sk, start_pos[0]
+                                   , start_pos[1], start_pos[2]);
+    }
+    struct stepper_kinematics *esk = extruder_stepper_alloc();
+    extruder_set_smooth_time(esk, bc.pressure_advance ? bc.pa_smooth_time : 0.);
+    setup_stepper(&bs, esk, bs.extruder_tq, bc.step_dist / 8., 0.);
+    itersolve_set_position(esk, start_pos[3], 0., 0.);
+
+    // Setup mcu command output
+    FILE *f = tmpfile();
+    if (!f) {
+        perror("tmpfile");
+        return -1;
+    }
+    bs.sq = serialqueue_alloc(fileno(f), SQT_FD, 1);
+    // Set a clock estimate that allows all messages to be sent immediately
+    serialqueue_set_clock_est(bs.sq, bc.mcu_freq, get_monotonic()
+                              , 1ULL << 62);
+    struct stepcompress *sc_list[MAX_STEPPERS];
+    for (i=0; i<bs.num_steppers; i++)
+        sc_list[i] = bs.steppers[i].sc;
+    bs.ss = steppersync_alloc(bs.sq, sc_list, bs.num_steppers, bc.move_num);
+    bs.sgb = stepgen_batch_alloc(bc.threads);
+    if (!bs.sgb)
+        return -1;
+    steppersync_set_time(bs.ss, 0., bc.mcu_freq);
+    if (steppersync_set_compress_threads(bs.ss, bc.compress_threads))
+        return -1;
+
+    // Run benchmark
+    double start = get_monotonic();
+    int ret = queue_moves(&bs);
+    double total_time = get_monotonic() - start;
+    wait_serialqueue(bs.sq);
+    serialqueue_exit(bs.sq);
+    if (ret) {
+        fprintf(stderr, "%s: error %d during step generation\n"
+                , bk->name, ret);
+        return ret;
+    }
+
+    // Report results
+    struct bench_output bo;
+    ret = decode_output(fileno(f), &bo);
+    if (ret) {
+        perror("decode_output");
+        return ret;
+    }
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    printf("%s: moves=%d steps=%llu queue_step=%llu (add2=%llu)"
+           " set_next_step_dir=%llu bytes=%llu\n", bk->name, bs.flushed_moves
+           , (unsigned long long)bo.steps
+           , (unsigned long long)bo.queue_step_msgs
+           , (unsigned long long)bo.add2_msgs
+           , (unsigned long long)bo.dir_msgs, (unsigned long long)bo.bytes);
+    printf("%s: time=%.3f (plan=%.3f gen=%.3f flush=%.3f) moves/s=%.0f"
+           " steps/s=%.0f queue_step/s=%.0f steps/msg=%.2f"
+           " peak_rss=%ldKiB\n", bk->name, total_time
+           , bs.plan_time, bs.gen_time, bs.flush_time
+           , bs.flushed_moves / total_time, bo.steps / total_time
+           , bo.queue_step_msgs / total_time
+           , bo.queue_step_msgs ? (double)bo.steps / bo.queue_step_msgs : 0.
+           , ru.ru_maxrss);
+    char tq_stats[128], mq_stats[128];
+    trapq_get_stats(bs.tq, tq_stats, sizeof(tq_stats));
+    moveq_get_stats(bs.mq, mq_stats, sizeof(mq_stats));
+    printf("%s: %s %s\n", bk->name, tq_stats, mq_stats);
+    fflush(stdout);
+
+    // Release resources
+    stepgen_batch_free(bs.sgb);
+    steppersync_free(bs.ss);
+    serialqueue_free(bs.sq);
+    fclose(f);
+    for (i=0; i<bs.num_steppers; i++) {
+        stepcompress_free(bs.steppers[i].sc);
+        free(bs.steppers[i].sk);
+        free(bs.steppers[i].orig_sk);
+    }
+    trapq_free(bs.tq);
+    trapq_free(bs.extruder_tq);
+    moveq_free(bs.mq);
+    return 0;
+}
+
+
+/****************************************************************
+ * Startup
+ ****************************************************************/
+
+static void
+usage(const char *prog)
+{
+    fprintf(stderr,
+            "Usage: %s [options] [gcode file]\n"
+            "  -k, --kinematics NAME     kinematics to test (or 'all')\n"
+            "  -n, --moves COUNT         number of synthetic moves\n"
+            "  -o, --accel-order N       acceleration order (2, 4, or 6)\n"
+            "  -a, --accel ACCEL         maximum acceleration\n"
+            "  -v, --velocity VELOCITY   maximum velocity\n"
+            "  -d, --step-distance DIST  stepper step distance\n"
+            "  -p, --pressure-advance PA extruder pressure advance\n"
+            "  -s, --smooth-time TIME    smooth_axis smoothing time\n"
+            "  -j, --threads COUNT       step generation threads\n"
+            "  -c, --compress-threads N  background step compression threads\n"
+            "  -m, --compress-mode MODE  step compression (0=greedy 1=search)\n"
+            "  -2, --add2                use the queue_step_add2 command\n"
+            , prog);
+}
+
+int
+main(int argc, char **argv)
+{
+    static const struct option long_options[] = {
+        { "kinematics", required_argument, NULL, 'k' },
+        { "moves", required_argument, NULL, 'n' },
+        { "accel-order", required_argument, NULL, 'o' },
+        { "accel", required_argument, NULL, 'a' },
+        { "velocity", required_argument, NULL, 'v' },
+        { "step-distance", required_argument, NULL, 'd' },
+        { "pressure-advance", required_argument, NULL, 'p' },
+        { "smooth-time", required_argument, NULL, 's' },
+        { "threads", required_argument, NULL, 'j' },
+        { "compress-threads", required_argument, NULL, 'c' },
+        { "compress-mode", required_argument, NULL, 'm' },
+        { "add2", no_argument, NULL, '2' },
+        { "help", no_argument, NULL, 'h' },
+        { NULL, 0, NULL, 0 },
+    };
+    int c;
+    while ((c = getopt_long(argc, argv, "k:n:o:a:v:d:p:s:j:c:m:2h", long_options
+                            , NULL)) != -1) {
+        switch (c) {
+        case 'k': bc.kinematics = optarg; break;
+        case 'n': bc.synth_moves = atoi(optarg); break;
+        case 'o': bc.accel_order = atoi(optarg); break;
+        case 'a': bc.max_accel = atof(optarg); break;
+        case 'v': bc.max_velocity = atof(optarg); break;
+        case 'd': bc.step_dist = atof(optarg); break;
+        case 'p': bc.pressure_advance = atof(optarg); break;
+        case 's': bc.smooth_time = atof(optarg); break;
+        case 'j': bc.threads = atoi(optarg); break;
+        case 'c': bc.compress_threads = atoi(optarg); break;
+        case 'm': bc.compress_mode = atoi(optarg); break;
+        case '2': bc.add2 = 1; break;
+        default:
+            usage(argv[0]);
+            return c == 'h' ? 0 : -1;
+        }
+    }
+    if (optind < argc - 1 || bc.step_dist <= 0. || bc.max_accel <= 0.
+        || (bc.accel_order != 2 && bc.accel_order != 4
+            && bc.accel_order != 6)) {
+        usage(argv[0]);
+        return -1;
+    }
+    if (optind < argc)
+        bc.gcode_file = argv[optind];
+    bc.accel_to_decel = bc.max_accel * .5;
+    bc.jerk = bc.max_accel * 30.;
+
+    // Load move stream
+    struct bench_moves bm;
+    memset(&bm, 0, sizeof(bm));
+    if (bc.gcode_file) {
+        if (moves_parse_gcode(&bm, bc.gcode_file))
+            return -1;
+    } else {
+        moves_synthetic(&bm, bc.synth_moves);
+    }
+    if (bm.count < 2) {
+        fprintf(stderr, "No moves to process\n");
+        return -1;
+    }
+
+    // Run each kinematics in a separate process
+    int i, found = 0, failed = 0;
+    for (i=0; i<ARRAY_SIZE(bench_kins); i++) {
+        const struct bench_kin *bk = &bench_kins[i];
+        if (strcmp(bc.kinematics, "all") && strcmp(bc.kinematics, bk->name))
+            continue;
+        found = 1;
+        pid_t pid = fork();
+        if (pid < 0) {
+            perror("fork");
+            return -1;
+        }
+        if (!pid)
+            exit(run_kinematics(bk, &bm) ? 1 : 0);
+        int status;
+        waitpid(pid, &status, 0);
+        if (!WIFEXITED(status) || WEXITSTATUS(status))
+            failed = 1;
+    }
+    if (!found) {
+        fprintf(stderr, "Unknown kinematics '%s'\n", bc.kinematics);
+        return -1;
+    }
+    return failed ? -1 : 0;
+}
@@ -4,7 +4,7 @@
 //
 // This file may be distributed under the terms of the GNU GPLv3 license.
 
-#include <math.h> // fabs
+#include <math.h> // fabs, sqrt
 #include <stddef.h> // offsetof
 #include <string.h> // memset
 #include "compiler.h" // __visible
@@ -140,6 +140,190 @@ itersolve_gen_steps_range(struct stepper_kinematics *sk, struct move *m
 }
 
 
+/****************************************************************
+ * Polynomial solver for linear kinematics
+ ****************************************************************/
+
+#define MAX_NEWTON_ITERS 32
+
+// Find the time that a constant acceleration move reaches the given
+// distance (the distance must be within the low_time/high_time range)
+static double
+linear_find_step_time(const struct scurve *s, double dist
+                      , double low_time, double high_time)
+{
+    // Solve 'c2*t^2 + c1*t = dist' directly
+    double disc = s->c1 * s->c1 + 4. * s->c2 * dist;
+    double denom = s->c1 + sqrt(disc > 0. ? disc : 0.);
+    double time = denom > 0. ? 2. * dist / denom : low_time;
+    if (time < low_time)
+        return low_time;
+    if (time > high_time)
+        return high_time;
+    return time;
+}
+
+// Find the times of several consecutive steps on a higher order move.
+// This runs Newton's method (falling back to bisection if a guess
+// leaves the known low/high range) on all the steps in parallel, so
+// that each iteration probes all the candidate step times with a
+// single batch scurve evaluation.  The distances must be increasing
+// and within the distances of the low_time/high_time range.
+static void
+linear_find_step_times(const struct scurve *s, const double *dists
+                       , double *times, int count
+                       , double low_time, double high_time)
+{
+    double low[SCURVE_BATCH], high[SCURVE_BATCH];
+    double pos[SCURVE_BATCH], vel[SCURVE_BATCH];
+    // Initial guesses extrapolate from the velocity and acceleration
+    // at low_time
+    double start_dist = scurve_eval(s, low_time);
+    double start_v = scurve_velocity(s, low_time);
+    double start_a = scurve_accel(s, low_time);
+    int i;
+    for (i=0; i<count; i++) {
+        low[i] = low_time;
+        high[i] = high_time;
+        double dist = dists[i] - start_dist;
+        double disc = start_v * start_v + 2. * start_a * dist;
+        double denom = start_v + sqrt(disc > 0. ? disc : 0.);
+        double time = denom > 0. ? low_time + 2. * dist / denom : -1.;
+        if (!(time > low_time && time < high_time))
+            time = .5 * (low_time + high_time);
+        times[i] = time;
+    }
+    int iter;
+    for (iter=0; iter<MAX_NEWTON_ITERS; iter++) {
+        scurve_eval_batch(s, times, pos, vel, count);
+        int done = 1;
+        for (i=0; i<count; i++) {
+            double time = times[i], diff = pos[i] - dists[i];
+            if (diff > 0.)
+                high[i] = time;
+            else if (diff < 0.)
+                low[i] = time;
+            else
+                continue;
+            double next_time = time - diff / vel[i];
+            if (!(next_time > low[i] && next_time < high[i]))
+                next_time = .5 * (low[i] + high[i]);
+            if (fabs(next_time - time) > .000000001)
+                done = 0;
+            times[i] = next_time;
+        }
+        if (done)
+            break;
+    }
+    for (i=0; i<count; i++) {
+        if (times[i] < low_time)
+            times[i] = low_time;
+        else if (times[i] > high_time)
+            times[i] = high_time;
+    }
+}
+
+// Generate step times for a portion of a move on a stepper whose
+// position is a linear function of the move's coordinates.  In that
+// case the stepper position is 'base + ratio * scurve_eval(time)' and
+// is monotonic over the move, so each step time can be found directly.
+static int32_t
+itersolve_gen_steps_linear(struct stepper_kinematics *sk, struct move *m
+                           , double abs_start, double abs_end)
+{
+    const double *lc = sk->linear_coeffs;
+    double base = (lc[0] * m->start_pos.x + lc[1] * m->start_pos.y
+                   + lc[2] * m->start_pos.z);
+    double ratio = (lc[0] * m->axes_r.x + lc[1] * m->axes_r.y
+                    + lc[2] * m->axes_r.z);
+    double last_pos = sk->commanded_pos, half_step = .5 * sk->step_dist;
+    if (!ratio) {
+        if (fabs(base - last_pos) >= half_step)
+            // Stepper is not at the move position - use iterative solver
+            return itersolve_gen_steps_range(sk, m, abs_start, abs_end);
+        // Stepper does not move during this move
+        return 0;
+    }
+    double start = abs_start - m->print_time, end = abs_end - m->print_time;
+    if (start < 0.)
+        start = 0.;
+    if (end > m->move_t)
+        end = m->move_t;
+    const struct scurve *s = &m->s;
+    int sdir = ratio > 0.;
+    double inv_ratio = 1. / ratio;
+    double start_dist = scurve_eval(s, start), end_dist = scurve_eval(s, end);
+    double last_dist = (last_pos - base) * inv_ratio;
+    if (last_dist - start_dist >= half_step * fabs(inv_ratio))
+        // Stepper must first step backwards - use iterative solver
+        return itersolve_gen_steps_range(sk, m, abs_start, abs_end);
+    if (!sdir)
+        half_step = -half_step;
+    double last_time = start;
+    if (s->c3 || s->c4 || s->c5 || s->c6) {
+        // Higher order curve - find the step times in batches
+        for (;;) {
+            double dists[SCURVE_BATCH], times[SCURVE_BATCH];
+            double next_pos[SCURVE_BATCH], pos = last_pos;
+            int i, count = 0;
+            for (i=0; i<SCURVE_BATCH; i++) {
+                double target = pos + half_step;
+                dists[i] = (target - base) * inv_ratio;
+                if (dists[i] > end_dist)
+                    break;
+                pos = next_pos[i] = target + half_step;
+                count++;
+            }
+            if (!count)
+                break;
+            linear_find_step_times(s, dists, times, count, last_time, end);
+            for (i=0; i<count; i++) {
+                int ret = stepcompress_append(sk->sc, sdir, m->print_time
+                                              , times[i]);
+                if (ret)
+                    return ret;
+            }
+            last_time = times[count-1];
+            last_pos = next_pos[count-1];
+        }
+    } else {
+        for (;;) {
+            double target = last_pos + half_step;
+            double dist = (target - base) * inv_ratio;
+            if (dist > end_dist)
+                break;
+            double time = linear_find_step_time(s, dist, last_time, end);
+            int ret = stepcompress_append(sk->sc, sdir, m->print_time, time);
+            if (ret)
+                return ret;
+            last_time = time;
+            last_pos = target + half_step;
+        }
+    }
+    if (end_dist > (last_pos - base) * inv_ratio
+        && stepcompress_get_step_dir(sk->sc) == sdir) {
+        // Avoid rollback if stepper fully reaches target position
+        int ret = stepcompress_commit(sk->sc);
+        if (ret)
+            return ret;
+    }
+    sk->commanded_pos = last_pos;
+    if (sk->post_cb)
+        sk->post_cb(sk);
+    return 0;
+}
+
+// Generate step times for a portion of a move
+static inline int32_t
+gen_steps_range(struct stepper_kinematics *sk, struct move *m
+                , double abs_start, double abs_end)
+{
+    if (sk->is_linear)
+        return itersolve_gen_steps_linear(sk, m, abs_start, abs_end);
+    return itersolve_gen_steps_range(sk, m, abs_start, abs_end);
+}
+
+
 /****************************************************************
  * Interface functions
  ****************************************************************/
@@ -155,17 +339,18 @@ check_active(struct stepper_kinematics *sk, struct move *m)
 }
 
 // Generate step times for a range of moves on the trapq
-int32_t __visible
-itersolve_generate_steps(struct stepper_kinematics *sk, double flush_time)
+static int32_t
+generate_steps(struct stepper_kinematics *sk, double flush_time)
 {
     double last_flush_time = sk->last_flush_time;
     sk->last_flush_time = flush_time;
     if (!sk->tq)
         return 0;
-    trapq_check_sentinels(sk->tq);
-    struct move *m = list_first_entry(&sk->tq->moves, struct move, node);
-    while (last_flush_time >= m->print_time + m->move_t)
-        m = list_next_entry(m, node);
+    struct trapq *tq = sk->tq;
+    trapq_check_sentinels(tq);
+    if (sk->integral_flags)
+        trapq_update_integrals(tq, sk->integral_flags);
+    struct move *m = trapq_seek(tq, &sk->tq_cursor, last_flush_time);
     double force_steps_time = sk->last_move_time + sk->gen_steps_post_active;
     int skip_count = 0;
     for (;;) {
@@ -178,24 +363,24 @@ itersolve_generate_steps(struct stepper_kinematics *sk, double flush_time)
                     abs_start = last_flush_time;
                 if (abs_start < force_steps_time)
                     abs_start = force_steps_time;
-                struct move *pm = list_prev_entry(m, node);
+                struct move *pm = trapq_prev(tq, m);
                 while (--skip_count && pm->print_time > abs_start)
-                    pm = list_prev_entry(pm, node);
+                    pm = trapq_prev(tq, pm);
                 do {
-                    int32_t ret = itersolve_gen_steps_range(sk, pm, abs_start
-                                                            , flush_time);
+                    int32_t ret = gen_steps_range(sk, pm, abs_start
+                                                  , flush_time);
                     if (ret)
                         return ret;
-                    pm = list_next_entry(pm, node);
+                    pm = trapq_next(tq, pm);
                 } while (pm != m);
             }
             // Generate steps for this move
-            int32_t ret = itersolve_gen_steps_range(sk, m, last_flush_time
-                                                    , flush_time);
+            int32_t ret = gen_steps_range(sk, m, last_flush_time, flush_time);
             if (ret)
                 return ret;
             if (move_end >= flush_time) {
                 sk->last_move_time = flush_time;
+                sk->tq_cursor = trapq_index(tq, m);
                 return 0;
             }
             skip_count = 0;
@@ -207,8 +392,7 @@ itersolve_generate_steps(struct stepper_kinematics *sk, double flush_time)
                 double abs_end = force_steps_time;
                 if (abs_end > flush_time)
                     abs_end = flush_time;
-                int32_t ret = itersolve_gen_steps_range(sk, m, last_flush_time
-                                                        , abs_end);
+                int32_t ret = gen_steps_range(sk, m, last_flush_time, abs_end);
                 if (ret)
                     return ret;
                 skip_count = 1;
@@ -216,29 +400,45 @@ itersolve_generate_steps(struct stepper_kinematics *sk, double flush_time)
                 // This move doesn't impact this stepper - skip it
                 skip_count++;
             }
-            if (flush_time + sk->gen_steps_pre_active <= move_end)
+            if (flush_time + sk->gen_steps_pre_active <= move_end) {
+                sk->tq_cursor = trapq_index(tq, m);
                 return 0;
+            }
         }
-        m = list_next_entry(m, node);
+        m = trapq_next(tq, m);
     }
 }
 
+// Generate step times up to 'flush_time' for a stepper
+int32_t __visible
+itersolve_generate_steps(struct stepper_kinematics *sk, double flush_time)
+{
+    // The step queue may still be in use by background compression
+    int32_t ret = stepcompress_wait(sk->sc);
+    if (ret)
+        return ret;
+    ret = generate_steps(sk, flush_time);
+    if (ret)
+        return ret;
+    stepcompress_submit(sk->sc);
+    return 0;
+}
+
 // Check if the given stepper is likely to be active in the given time range
 double __visible
 itersolve_check_active(struct stepper_kinematics *sk, double flush_time)
 {
     if (!sk->tq)
         return 0.;
-    trapq_check_sentinels(sk->tq);
-    struct move *m = list_first_entry(&sk->tq->moves, struct move, node);
-    while (sk->last_flush_time >= m->print_time + m->move_t)
-        m = list_next_entry(m, node);
+    struct trapq *tq = sk->tq;
+    trapq_check_sentinels(tq);
+    struct move *m = trapq_seek(tq, &sk->tq_cursor, sk->last_flush_time);
     for (;;) {
         if (check_active(sk, m))
             return m->print_time;
         if (flush_time <= m->print_time + m->move_t)
             return 0.;
-        m = list_next_entry(m, node);
+        m = trapq_next(tq, m);
     }
 }
 
@@ -255,6 +455,7 @@ void __visible
 itersolve_set_trapq(struct stepper_kinematics *sk, struct trapq *tq)
 {
     sk->tq = tq;
+    sk->tq_cursor = 0;
 }
 
 void __visible
@@ -290,3 +491,15 @@ itersolve_get_commanded_pos(struct stepper_kinematics *sk)
 {
     return sk->commanded_pos;
 }
+
+// Note that the stepper position is 'x_r*x + y_r*y + z_r*z' so that
+// step times may be found by solving the move polynomial directly
+void
+itersolve_set_linear(struct stepper_kinematics *sk
+                     , double x_r, double y_r, double z_r)
+{
+    sk->is_linear = 1;
+    sk->linear_coeffs[0] = x_r;
+    sk->linear_coeffs[1] = y_r;
+    sk->linear_coeffs[2] = z_r;
+}
@@ -18,11 +18,19 @@ struct stepper_kinematics {
 
     double last_flush_time, last_move_time;
     struct trapq *tq;
+    unsigned int tq_cursor;
     int active_flags;
     double gen_steps_pre_active, gen_steps_post_active;
+    // Move integral caches used by calc_position_cb (TQI_* flags)
+    int integral_flags;
 
     sk_calc_callback calc_position_cb;
     sk_post_callback post_cb;
+
+    // Stepper position is a fixed linear combination of the move's
+    // x, y, and z coordinates (enables the polynomial step solver)
+    int is_linear;
+    double linear_coeffs[3];
 };
 
 int32_t itersolve_generate_steps(struct stepper_kinematics *sk
@@ -37,5 +45,7 @@ double itersolve_calc_position_from_coord(struct stepper_kinematics *sk
 void itersolve_set_position(struct stepper_kinematics *sk
                             , double x, double y, double z);
 double itersolve_get_commanded_pos(struct stepper_kinematics *sk);
+void itersolve_set_linear(struct stepper_kinematics *sk
+                          , double x_r, double y_r, double z_r);
 
 #endif // itersolve.h
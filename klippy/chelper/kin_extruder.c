@@ -70,26 +70,71 @@ pa_move_integrate(struct move *m, double start, double end, double time_offset)
     return wgt_ext - time_offset * iext;
 }
 
+// Calculate the definitive integral of the extruder over a range of
+// full moves using the trapq move integral cache.  The weight of each
+// move is 'sign * (t - T) + hst' where T is the smoothing window center.
+static double
+pa_cached_integrate(struct trapq *tq, const struct move *first
+                    , const struct move *last, double time, double hst
+                    , double sign)
+{
+    const double *s = trapq_prefix_pa(tq, first);
+    const double *e = trapq_prefix_pa(tq, last);
+    double c = time - tq->integrals_time;
+    return sign * (e[1] - s[1]) + (hst - sign * c) * (e[0] - s[0]);
+}
+
 // Calculate the definitive integral of the extruder over a range of moves
 static double
-pa_range_integrate(struct move *m, double move_time, double hst)
+pa_range_integrate(struct trapq *tq, struct move *m, double move_time
+                   , double hst)
 {
     // Calculate integral for the current move
     double res = 0., start = move_time - hst, end = move_time + hst;
     res += pa_move_integrate(m, start, move_time, start);
     res -= pa_move_integrate(m, move_time, end, end);
+    if (likely(start >= 0. && end <= m->move_t))
+        // Smoothing window is entirely within the current move
+        return res;
+    int use_cache = tq->integral_flags & TQI_PA;
+    double time = m->print_time + move_time;
     // Integrate over previous moves
-    struct move *prev = m;
-    while (unlikely(start < 0.)) {
-        prev = list_prev_entry(prev, node);
-        start += prev->move_t;
-        res += pa_move_integrate(prev, start, prev->move_t, start);
+    if (unlikely(start < 0.)) {
+        struct move *first = m;
+        while (start < 0.) {
+            first = trapq_prev(tq, first);
+            start += first->move_t;
+        }
+        res += pa_move_integrate(first, start, first->move_t, start);
+        double offset = start - first->move_t;
+        struct move *prev = trapq_next(tq, first);
+        if (use_cache && prev != m) {
+            res += pa_cached_integrate(tq, prev, m, time, hst, 1.);
+        } else {
+            for (; prev != m; prev = trapq_next(tq, prev)) {
+                res += pa_move_integrate(prev, 0., prev->move_t, offset);
+                offset -= prev->move_t;
+            }
+        }
     }
     // Integrate over future moves
-    while (unlikely(end > m->move_t)) {
-        end -= m->move_t;
-        m = list_next_entry(m, node);
-        res -= pa_move_integrate(m, 0., end, end);
+    if (unlikely(end > m->move_t)) {
+        struct move *last = m;
+        double offset = end - m->move_t;
+        while (end > last->move_t) {
+            end -= last->move_t;
+            last = trapq_next(tq, last);
+        }
+        res -= pa_move_integrate(last, 0., end, end);
+        struct move *next = trapq_next(tq, m);
+        if (use_cache && next != last) {
+            res += pa_cached_integrate(tq, next, last, time, hst, -1.);
+        } else {
+            for (; next != last; next = trapq_next(tq, next)) {
+                res -= pa_move_integrate(next, 0., next->move_t, offset);
+                offset -= next->move_t;
+            }
+        }
     }
     return res;
 }
@@ -109,7 +154,7 @@ extruder_calc_position(struct stepper_kinematics *sk, struct move *m
         // Pressure advance not enabled
         return m->start_pos.x + m->axes_r.x * move_get_distance(m, move_time);
     // Apply pressure advance and average over smooth_time
-    double area = pa_range_integrate(m, move_time, hst);
+    double area = pa_range_integrate(sk->tq, m, move_time, hst);
     return area * es->inv_half_smooth_time2;
 }
 
@@ -120,6 +165,7 @@ extruder_set_smooth_time(struct stepper_kinematics *sk, double smooth_time)
     double hst = smooth_time * .5;
     es->half_smooth_time = hst;
     es->sk.gen_steps_pre_active = es->sk.gen_steps_post_active = hst;
+    es->sk.integral_flags = hst ? TQI_PA : 0;
     if (! hst)
         return;
     es->inv_half_smooth_time2 = 1. / (hst * hst);
@@ -12,7 +12,7 @@
 #include "integrate.h" // integrate_weighted
 #include "itersolve.h" // struct stepper_kinematics
 #include "scurve.h" // scurve_copy_scaled
-#include "trapq.h" // trapq_integrate
+#include "trapq.h" // trapq_move_integrals
 
 // Calculate the definitive integral on part of a move
 static double
@@ -40,47 +40,91 @@ move_integrate(const struct move *m, int axis, double start, double end
     return res;
 }
 
+// Calculate the definitive integral over a range of full moves using
+// the trapq move integral cache
+static double
+cached_range_integrate(struct trapq *tq, const struct move *first
+                       , const struct move *last, int axis, double offset
+                       , const struct smoother *sm
+                       , double damping_comp, double accel_comp)
+{
+    // Sum the even moments of the moves about the window center T.  The
+    // moments of each move are relative to its own start, which is
+    // 'offset' from T, so only small offsets enter the shifted terms.
+    double mom0 = 0., mom2 = 0., mom4 = 0.;
+    const struct move *m;
+    for (m = first; m != last; m = trapq_next(tq, m)) {
+        const double (*mi)[TQI_MOMENTS] =
+            trapq_move_integrals(tq, m)->axes[axis - 'x'];
+        double l[TQI_MOMENTS];
+        int k;
+        for (k=0; k<TQI_MOMENTS; k++)
+            l[k] = mi[0][k] + damping_comp * mi[1][k] + accel_comp * mi[2][k];
+        double o = offset, o2 = o * o;
+        mom0 += l[0];
+        mom2 += l[2] + 2. * o * l[1] + o2 * l[0];
+        mom4 += (l[4] + 4. * o * l[3] + 6. * o2 * l[2]
+                 + 4. * o2 * o * l[1] + o2 * o2 * l[0]);
+        offset += m->move_t;
+    }
+    // Expand the weight ((t-T)^2-h^2)^2
+    double h2 = sm->h2;
+    return mom4 - 2. * h2 * mom2 + h2 * h2 * mom0;
+}
+
 // Calculate the definitive integral for a range of moves
 static double
-range_integrate(const struct move *m, int axis, double move_time
-                , const struct smoother *sm
+range_integrate(struct trapq *tq, const struct move *m, int axis
+                , double move_time, const struct smoother *sm
                 , double damping_comp, double accel_comp)
 {
-    // Calculate integral for the current move
     double start = move_time - sm->hst, end = move_time + sm->hst;
-    double offset = -move_time;
-    double res = move_integrate(m, axis, start, end, offset, sm
-                                , damping_comp, accel_comp);
-    // Integrate over previous moves
-    const struct move *prev = m;
-    while (unlikely(start < 0.)) {
-        prev = list_prev_entry(prev, node);
-        start += prev->move_t;
-        offset -= prev->move_t;
-        res += move_integrate(prev, axis, start, prev->move_t, offset, sm
+    if (likely(start >= 0. && end <= m->move_t))
+        // Smoothing window is entirely within the current move
+        return move_integrate(m, axis, start, end, -move_time, sm
                               , damping_comp, accel_comp);
+    // Find the first and last moves of the smoothing window
+    const struct move *first = m, *last = m;
+    double first_offset = -move_time, last_offset = -move_time;
+    while (start < 0.) {
+        first = trapq_prev(tq, first);
+        start += first->move_t;
+        first_offset -= first->move_t;
     }
-    // Integrate over future moves
-    offset = -move_time;
-    while (unlikely(end > m->move_t)) {
-        end -= m->move_t;
-        offset += m->move_t;
-        m = list_next_entry(m, node);
-        res += move_integrate(m, axis, 0., end, offset, sm
+    while (end > last->move_t) {
+        end -= last->move_t;
+        last_offset += last->move_t;
+        last = trapq_next(tq, last);
+    }
+    // Integrate the partial moves at the ends of the window
+    double res = move_integrate(first, axis, start, first->move_t
+                                , first_offset, sm, damping_comp, accel_comp);
+    res += move_integrate(last, axis, 0., end, last_offset, sm
+                          , damping_comp, accel_comp);
+    // Integrate over the full moves in the middle of the window
+    const struct move *mid = trapq_next(tq, first);
+    double offset = first_offset + first->move_t;
+    if (tq->integral_flags & TQI_AXES)
+        return res + cached_range_integrate(
+            tq, mid, last, axis, offset, sm, damping_comp, accel_comp);
+    for (; mid != last; mid = trapq_next(tq, mid)) {
+        res += move_integrate(mid, axis, 0., mid->move_t, offset, sm
                               , damping_comp, accel_comp);
+        offset += mid->move_t;
     }
     return res;
 }
 
 // Calculate average position over smooth_time window
 static inline double
-calc_position(const struct move *m, int axis, double move_time
+calc_position(struct trapq *tq, const struct move *m, int axis
+              , double move_time
               , const struct smoother *sm
               , double damping_ratio, double accel_comp)
 {
     accel_comp *= (1. - damping_ratio * damping_ratio);
     double damping_comp = 2. * damping_ratio * sqrt(accel_comp);
-    double area = range_integrate(m, axis, move_time, sm
+    double area = range_integrate(tq, m, axis, move_time, sm
                                   , damping_comp, accel_comp);
     return area * sm->inv_norm;
 }
@@ -104,8 +148,9 @@ smooth_x_calc_position(struct stepper_kinematics *sk, struct move *m
     struct smooth_axis *sa = container_of(sk, struct smooth_axis, sk);
     if (!sa->x_smoother)
         return sa->orig_sk->calc_position_cb(sa->orig_sk, m, move_time);
-    sa->m.start_pos.x = calc_position(m, 'x', move_time, sa->x_smoother
-                                      , sa->x_damping_ratio, sa->x_accel_comp);
+    sa->m.start_pos.x = calc_position(sk->tq, m, 'x', move_time
+                                      , sa->x_smoother, sa->x_damping_ratio
+                                      , sa->x_accel_comp);
     return sa->orig_sk->calc_position_cb(sa->orig_sk, &sa->m, DUMMY_T);
 }
 
@@ -117,8 +162,9 @@ smooth_y_calc_position(struct stepper_kinematics *sk, struct move *m
     struct smooth_axis *sa = container_of(sk, struct smooth_axis, sk);
     if (!sa->y_smoother)
         return sa->orig_sk->calc_position_cb(sa->orig_sk, m, move_time);
-    sa->m.start_pos.y = calc_position(m, 'y', move_time, sa->y_smoother
-                                      , sa->y_damping_ratio, sa->y_accel_comp);
+    sa->m.start_pos.y = calc_position(sk->tq, m, 'y', move_time
+                                      , sa->y_smoother, sa->y_damping_ratio
+                                      , sa->y_accel_comp);
     return sa->orig_sk->calc_position_cb(sa->orig_sk, &sa->m, DUMMY_T);
 }
 
@@ -132,11 +178,13 @@ smooth_xy_calc_position(struct stepper_kinematics *sk, struct move *m
         return sa->orig_sk->calc_position_cb(sa->orig_sk, m, move_time);
     sa->m.start_pos = move_get_coord(m, move_time);
     if (sa->x_smoother)
-        sa->m.start_pos.x = calc_position(m, 'x', move_time, sa->x_smoother
+        sa->m.start_pos.x = calc_position(sk->tq, m, 'x', move_time
+                                          , sa->x_smoother
                                           , sa->x_damping_ratio
                                           , sa->x_accel_comp);
     if (sa->y_smoother)
-        sa->m.start_pos.y = calc_position(m, 'y', move_time, sa->y_smoother
+        sa->m.start_pos.y = calc_position(sk->tq, m, 'y', move_time
+                                          , sa->y_smoother
                                           , sa->y_damping_ratio
                                           , sa->y_accel_comp);
     return sa->orig_sk->calc_position_cb(sa->orig_sk, &sa->m, DUMMY_T);
@@ -159,6 +207,7 @@ smooth_axis_set_time(struct stepper_kinematics *sk
     if (sa->sk.active_flags & AF_Y)
         hst = y_hst > hst ? y_hst : hst;
     sa->sk.gen_steps_pre_active = sa->sk.gen_steps_post_active = hst;
+    sa->sk.integral_flags = hst ? TQI_AXES : 0;
 }
 
 void __visible
@@ -0,0 +1,121 @@
+// Fixed size object pools
+//
+// Copyright (C) 2020  Kevin O'Connor <kevin@koconnor.net>
+//
+// This file may be distributed under the terms of the GNU GPLv3 license.
+
+// The move queues allocate and release a small object for every move
+// segment.  Rather than going through malloc() for each one, objects
+// are carved out of larger slabs and recycled via a free list.  The
+// slabs are only returned to the system on mempool_release().
+
+#include <stdlib.h> // malloc
+#include <string.h> // memset
+#include "compiler.h" // unlikely
+#include "mempool.h" // mempool_alloc
+
+#define MEMPOOL_ALIGN 16
+
+struct mempool_slab {
+    struct mempool_slab *next;
+};
+
+struct free_obj {
+    struct free_obj *next;
+};
+
+static size_t
+slab_header_size(void)
+{
+    return ALIGN(sizeof(struct mempool_slab), MEMPOOL_ALIGN);
+}
+
+// Initialize a pool of objects of size 'obj_size'
+void
+mempool_init(struct mempool *mp, size_t obj_size, int slab_objs)
+{
+    memset(mp, 0, sizeof(*mp));
+    if (obj_size < sizeof(struct free_obj))
+        obj_size = sizeof(struct free_obj);
+    mp->obj_size = ALIGN(obj_size, MEMPOOL_ALIGN);
+    mp->slab_objs = slab_objs > 0 ? slab_objs : 1;
+}
+
+// Add all the objects of a slab to the free list
+static void
+slab_add_free(struct mempool *mp, struct mempool_slab *slab)
+{
+    char *objs = (char*)slab + slab_header_size();
+    int i;
+    for (i=mp->slab_objs-1; i>=0; i--) {
+        struct free_obj *fo = (void*)&objs[i * mp->obj_size];
+        fo->next = mp->free_list;
+        mp->free_list = fo;
+    }
+}
+
+// Allocate a new slab and add its objects to the free list
+static int
+mempool_grow(struct mempool *mp)
+{
+    struct mempool_slab *slab = malloc(
+        slab_header_size() + mp->obj_size * mp->slab_objs);
+    if (!slab)
+        return -1;
+    slab->next = mp->slabs;
+    mp->slabs = slab;
+    slab_add_free(mp, slab);
+    mp->size += mp->slab_objs;
+    return 0;
+}
+
+// Allocate a zero initialized object from the pool
+void *
+mempool_alloc(struct mempool *mp)
+{
+    if (unlikely(!mp->free_list) && mempool_grow(mp))
+        return NULL;
+    struct free_obj *fo = mp->free_list;
+    mp->free_list = fo->next;
+    mp->in_use++;
+    if (mp->in_use > mp->high_water)
+        mp->high_water = mp->in_use;
+    memset(fo, 0, mp->obj_size);
+    return fo;
+}
+
+// Return an object to the pool
+void
+mempool_free(struct mempool *mp, void *obj)
+{
+    struct free_obj *fo = obj;
+    fo->next = mp->free_list;
+    mp->free_list = fo;
+    mp->in_use--;
+}
+
+// Return all objects to the pool at once (invalidates all its objects)
+void
+mempool_recycle(struct mempool *mp)
+{
+    mp->free_list = NULL;
+    struct mempool_slab *slab;
+    for (slab = mp->slabs; slab; slab = slab->next)
+        slab_add_free(mp, slab);
+    mp->in_use = 0;
+}
+
+// Release all memory held by the pool (invalidates all its objects)
+void
+mempool_release(struct mempool *mp)
+{
+    struct mempool_slab *slab = mp->slabs;
+    while (slab) {
+        struct mempool_slab *next = slab->next;
+        free(slab);
+        slab = next;
+    }
+    mp->slabs = NULL;
+    mp->free_list = NULL;
+    mp->size = mp->in_use = 0;
+}
@@ -0,0 +1,23 @@
+#ifndef MEMPOOL_H
+#define MEMPOOL_H
+
+#include <stddef.h> // size_t
+
+struct mempool_slab;
+
+struct mempool {
+    size_t obj_size;
+    int slab_objs;
+    void *free_list;
+    struct mempool_slab *slabs;
+    // Statistics
+    unsigned int size, in_use, high_water;
+};
+
+void mempool_init(struct mempool *mp, size_t obj_size, int slab_objs);
+void *mempool_alloc(struct mempool *mp);
+void mempool_free(struct mempool *mp, void *obj);
+void mempool_recycle(struct mempool *mp);
+void mempool_release(struct mempool *mp);
+
+#endif // mempool.h
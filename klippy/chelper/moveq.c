@@ -8,6 +8,7 @@
 #include <assert.h> // assert
 #include <math.h> // sqrt
 #include <stddef.h> // offsetof
+#include <stdio.h> // snprintf
 #include <stdlib.h> // malloc
 #include <string.h> // memset
 #include "accelgroup.h"
@@ -23,12 +24,13 @@
 
 static const double EPSILON = 0.000000001;
 
+// Number of moves allocated at a time in the moveq move pool
+#define QMOVE_POOL_SLAB 128
+
 static struct qmove *
-qmove_alloc(void)
+qmove_alloc(struct moveq *mq)
 {
-    struct qmove *m = malloc(sizeof(*m));
-    memset(m, 0, sizeof(*m));
-    return m;
+    return mempool_alloc(&mq->move_pool);
 }
 
 struct moveq * __visible
@@ -38,9 +40,30 @@ moveq_alloc(void)
     memset(mq, 0, sizeof(*mq));
     list_init(&mq->moves);
     init_combiner(&mq->accel_combiner);
+    mempool_init(&mq->move_pool, sizeof(struct qmove), QMOVE_POOL_SLAB);
     return mq;
 }
 
+// Free memory associated with a 'moveq' object
+void __visible
+moveq_free(struct moveq *mq)
+{
+    if (!mq)
+        return;
+    reset_combiner(&mq->accel_combiner);
+    mempool_release(&mq->move_pool);
+    free(mq);
+}
+
+// Report the move pool statistics of a 'moveq' object
+void __visible
+moveq_get_stats(struct moveq *mq, char *buf, int len)
+{
+    struct mempool *mp = &mq->move_pool;
+    snprintf(buf, len, "qmoves=%u qmoves_max=%u qmove_pool=%u"
+             , mp->in_use, mp->high_water, mp->size);
+}
+
 // Allocate a new 'move_accel_decel' object
 struct move_accel_decel * __visible
 move_accel_decel_alloc(void)
@@ -54,15 +77,14 @@ move_accel_decel_alloc(void)
 void __visible
 moveq_reset(struct moveq *mq)
 {
-    struct qmove *m = NULL, *nm = NULL;
-    list_for_each_entry_safe(m, nm, &mq->moves, node) {
-        list_del(&m->node);
-        free(m);
-    }
     reset_combiner(&mq->accel_combiner);
+    // Release all queued moves at once, but keep the pool slabs
+    struct mempool move_pool = mq->move_pool;
+    mempool_recycle(&move_pool);
     memset(mq, 0, sizeof(*mq));
     list_init(&mq->moves);
     init_combiner(&mq->accel_combiner);
+    mq->move_pool = move_pool;
 }
 
 static struct qmove *
@@ -281,7 +303,7 @@ moveq_add(struct moveq *mq, double move_d
           , int accel_order, double accel, double smoothed_accel
           , double jerk, double min_jerk_limit_time)
 {
-    struct qmove *m = qmove_alloc();
+    struct qmove *m = qmove_alloc(mq);
     m->move_d = move_d;
     fill_accel_group(&m->default_accel, m, accel_order, accel, jerk
             , min_jerk_limit_time);
@@ -379,7 +401,7 @@ moveq_getmove(struct moveq *mq, struct move_accel_decel *accel_decel)
     }
     // Remove processed move from the queue
     list_del(&move->node);
-    free(move);
+    mempool_free(&mq->move_pool, move);
     mq->prev_move_end_v = end_v;
     return 0;
 }
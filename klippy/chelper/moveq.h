@@ -5,6 +5,7 @@
 #include "accelgroup.h"
 #include "itersolve.h"
 #include "list.h"
+#include "mempool.h"
 
 struct trap_accel_decel;
 
@@ -39,12 +40,15 @@ struct moveq {
     struct accel_combiner accel_combiner;
     struct qmove *smoothed_pass_limit;
     double prev_move_end_v;
+    struct mempool move_pool;
 };
 
 struct move_accel_decel *move_accel_decel_alloc(void);
 
 struct moveq *moveq_alloc(void);
+void moveq_free(struct moveq *mq);
 void moveq_reset(struct moveq *mq);
+void moveq_get_stats(struct moveq *mq, char *buf, int len);
 
 int moveq_add(struct moveq *mq, double move_d
               , double junction_max_v2, double max_cruise_v2
@@ -36,6 +36,17 @@ scurve_velocity(const struct scurve *s, double time)
     return v;
 }
 
+double
+scurve_accel(const struct scurve *s, double time)
+{
+    double v = 30. * s->c6;
+    v = 20. * s->c5 + v * time;
+    v = 12. * s->c4 + v * time;
+    v = 6. * s->c3 + v * time;
+    v = 2. * s->c2 + v * time;
+    return v;
+}
+
 static void
 scurve_fill_bezier2(struct scurve *s, double start_accel_v
                   , double effective_accel, double accel_offset_t)
@@ -182,3 +193,54 @@ scurve_tn_antiderivative(const struct scurve *s, int n, double time)
         v *= time;
     return v * time;
 }
+
+
+/****************************************************************
+ * Batch evaluation
+ ****************************************************************/
+
+// The batch functions evaluate an S-Curve at several times at once.
+// They use gcc vector extensions so that the compiler emits SSE2 (or
+// AVX2) code on x86 and NEON code on aarch64.  On x86 an AVX2 variant
+// is also built and selected at runtime if the cpu supports it.  Other
+// targets fall back to scalar code generated from the same source.
+#if defined(__x86_64__)
+#define SCURVE_BATCH_CLONES __attribute__((target_clones("avx2","default")))
+#else
+#define SCURVE_BATCH_CLONES
+#endif
+
+typedef double v4d __attribute__((vector_size(SCURVE_BATCH * 8)));
+
+// Find the distance (and optionally the velocity) of an S-Curve at
+// 'count' times
+void SCURVE_BATCH_CLONES
+scurve_eval_batch(const struct scurve *s, const double *times
+                  , double *dists, double *velocities, int count)
+{
+    int i;
+    for (i=0; i+SCURVE_BATCH<=count; i+=SCURVE_BATCH) {
+        v4d t;
+        memcpy(&t, &times[i], sizeof(t));
+        v4d d = s->c6 * t + s->c5;
+        d = d * t + s->c4;
+        d = d * t + s->c3;
+        d = d * t + s->c2;
+        d = d * t + s->c1;
+        d = d * t;
+        memcpy(&dists[i], &d, sizeof(d));
+        if (!velocities)
+            continue;
+        v4d v = (6. * s->c6) * t + 5. * s->c5;
+        v = v * t + 4. * s->c4;
+        v = v * t + 3. * s->c3;
+        v = v * t + 2. * s->c2;
+        v = v * t + s->c1;
+        memcpy(&velocities[i], &v, sizeof(v));
+    }
+    for (; i<count; i++) {
+        dists[i] = scurve_eval(s, times[i]);
+        if (velocities)
+            velocities[i] = scurve_velocity(s, times[i]);
+    }
+}
@@ -8,6 +8,7 @@ struct scurve {
 
 double scurve_eval(const struct scurve *s, double time);
 double scurve_velocity(const struct scurve *s, double time);
+double scurve_accel(const struct scurve *s, double time);
 double scurve_tn_antiderivative(const struct scurve *s, int n, double time);
 
 void scurve_offset(struct scurve *s, double offset_t);
@@ -19,4 +20,9 @@ void scurve_fill(struct scurve *s, int accel_order
         , double start_accel_v, double effective_accel);
 double scurve_get_time(const struct scurve *s, double distance);
 
+#define SCURVE_BATCH 4
+
+void scurve_eval_batch(const struct scurve *s, const double *times
+                       , double *dists, double *velocities, int count);
+
 #endif // scurve.h
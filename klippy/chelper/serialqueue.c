@@ -12,6 +12,7 @@
 // clock times, prioritizes commands, and handles retransmissions.  A
 // background thread is launched to do this work and minimize latency.
 
+#include <errno.h> // errno
 #include <fcntl.h> // fcntl
 #include <math.h> // ceil
 #include <poll.h> // poll
@@ -21,6 +22,9 @@
 #include <stdio.h> // snprintf
 #include <stdlib.h> // malloc
 #include <string.h> // memset
+#include <sys/epoll.h> // epoll_wait
+#include <sys/timerfd.h> // timerfd_create
+#include <sys/uio.h> // writev
 #include <termios.h> // tcflush
 #include <unistd.h> // pipe
 #include "compiler.h" // __visible
@@ -34,7 +38,11 @@
  ****************************************************************/
 
 // The 'poll reactor' code is a mechanism for dispatching timer and
-// file descriptor events.
+// file descriptor events.  Timers are kept in a binary min-heap
+// ordered by wake-up time so that only due timers are visited.  On
+// Linux the reactor waits with epoll and wakes for timers with a
+// timerfd (which has a finer resolution than the millisecond timeout
+// of poll); if those can not be created it falls back to poll().
 
 #define PR_NOW   0.
 #define PR_NEVER 9999999999999999.
@@ -42,17 +50,47 @@
 struct pollreactor_timer {
     double waketime;
     double (*callback)(void *data, double eventtime);
+    int heap_pos;
 };
 
 struct pollreactor {
     int num_fds, num_timers, must_exit;
     void *callback_data;
-    double next_timer;
     struct pollfd *fds;
     void (**fd_callbacks)(void *data, double eventtime);
+    void (**fd_write_callbacks)(void *data, double eventtime);
     struct pollreactor_timer *timers;
+    struct pollreactor_timer **timer_heap;
+    // epoll support (epoll_fd is -1 when using poll)
+    int epoll_fd, timer_fd;
+    double timer_fd_waketime;
 };
 
+// Create the epoll and timerfd file descriptors (if available)
+static void
+pollreactor_setup_epoll(struct pollreactor *pr)
+{
+    pr->epoll_fd = pr->timer_fd = -1;
+    pr->timer_fd_waketime = PR_NEVER;
+    int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd < 0)
+        return;
+    int timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK|TFD_CLOEXEC);
+    if (timer_fd < 0)
+        goto fail;
+    struct epoll_event ev = { .events = EPOLLIN, .data.u32 = pr->num_fds };
+    int ret = epoll_ctl(epoll_fd, EPOLL_CTL_ADD, timer_fd, &ev);
+    if (ret < 0) {
+        close(timer_fd);
+        goto fail;
+    }
+    pr->epoll_fd = epoll_fd;
+    pr->timer_fd = timer_fd;
+    return;
+fail:
+    close(epoll_fd);
+}
+
 // Allocate a new 'struct pollreactor' object
 static void
 pollreactor_setup(struct pollreactor *pr, int num_fds, int num_timers
@@ -62,16 +100,25 @@ pollreactor_setup(struct pollreactor *pr, int num_fds, int num_timers
     pr->num_timers = num_timers;
     pr->must_exit = 0;
     pr->callback_data = callback_data;
-    pr->next_timer = PR_NEVER;
     pr->fds = malloc(num_fds * sizeof(*pr->fds));
     memset(pr->fds, 0, num_fds * sizeof(*pr->fds));
     pr->fd_callbacks = malloc(num_fds * sizeof(*pr->fd_callbacks));
     memset(pr->fd_callbacks, 0, num_fds * sizeof(*pr->fd_callbacks));
+    pr->fd_write_callbacks = malloc(num_fds * sizeof(*pr->fd_write_callbacks));
+    memset(pr->fd_write_callbacks, 0
+           , num_fds * sizeof(*pr->fd_write_callbacks));
     pr->timers = malloc(num_timers * sizeof(*pr->timers));
     memset(pr->timers, 0, num_timers * sizeof(*pr->timers));
+    pr->timer_heap = malloc(num_timers * sizeof(*pr->timer_heap));
     int i;
-    for (i=0; i<num_timers; i++)
+    for (i=0; i<num_fds; i++)
+        pr->fds[i].fd = -1;
+    for (i=0; i<num_timers; i++) {
         pr->timers[i].waketime = PR_NEVER;
+        pr->timers[i].heap_pos = i;
+        pr->timer_heap[i] = &pr->timers[i];
+    }
+    pollreactor_setup_epoll(pr);
 }
 
 // Free resources associated with a 'struct pollreactor' object
@@ -82,26 +129,125 @@ pollreactor_free(struct pollreactor *pr)
     pr->fds = NULL;
     free(pr->fd_callbacks);
     pr->fd_callbacks = NULL;
+    free(pr->fd_write_callbacks);
+    pr->fd_write_callbacks = NULL;
     free(pr->timers);
     pr->timers = NULL;
+    free(pr->timer_heap);
+    pr->timer_heap = NULL;
+    if (pr->epoll_fd >= 0) {
+        close(pr->timer_fd);
+        close(pr->epoll_fd);
+        pr->epoll_fd = pr->timer_fd = -1;
+    }
+}
+
+// Update the events polled on a file descriptor after its callbacks
+// change (an fd without callbacks is not polled at all)
+static void
+pollreactor_update_fd(struct pollreactor *pr, int pos, int fd)
+{
+    int was_polled = pr->fds[pos].fd >= 0;
+    short events = 0;
+    uint32_t epoll_events = 0;
+    if (pr->fd_callbacks[pos]) {
+        events |= POLLIN|POLLHUP;
+        epoll_events |= EPOLLIN|EPOLLHUP;
+    }
+    if (pr->fd_write_callbacks[pos]) {
+        events |= POLLOUT;
+        epoll_events |= EPOLLOUT;
+    }
+    pr->fds[pos].fd = events ? fd : -1;
+    pr->fds[pos].events = events;
+    pr->fds[pos].revents = 0;
+    if (pr->epoll_fd < 0 || (!events && !was_polled))
+        return;
+    struct epoll_event ev = { .events = epoll_events, .data.u32 = pos };
+    int op = (!events ? EPOLL_CTL_DEL
+              : (was_polled ? EPOLL_CTL_MOD : EPOLL_CTL_ADD));
+    int ret = epoll_ctl(pr->epoll_fd, op, fd, &ev);
+    if (ret < 0)
+        report_errno("epoll_ctl", ret);
 }
 
 // Add a callback for when a file descriptor (fd) becomes readable
 static void
 pollreactor_add_fd(struct pollreactor *pr, int pos, int fd, void *callback)
 {
-    pr->fds[pos].fd = fd;
-    pr->fds[pos].events = POLLIN|POLLHUP;
-    pr->fds[pos].revents = 0;
     pr->fd_callbacks[pos] = callback;
+    pollreactor_update_fd(pr, pos, fd);
+}
+
+// Set a callback for when a file descriptor (fd) becomes writable (or
+// stop checking for that if 'callback' is NULL)
+static void
+pollreactor_set_write_fd(struct pollreactor *pr, int pos, int fd
+                         , void *callback)
+{
+    if (pr->fd_write_callbacks[pos] == callback)
+        return;
+    pr->fd_write_callbacks[pos] = callback;
+    pollreactor_update_fd(pr, pos, fd);
+}
+
+// Invoke the callbacks of a file descriptor with pending events
+static void
+pollreactor_fd_event(struct pollreactor *pr, int pos, int readable
+                     , int writable, double eventtime)
+{
+    if (readable && pr->fd_callbacks[pos])
+        pr->fd_callbacks[pos](pr->callback_data, eventtime);
+    if (writable && pr->fd_write_callbacks[pos])
+        pr->fd_write_callbacks[pos](pr->callback_data, eventtime);
+}
+
+// Place a timer at the given position of the timer heap
+static void
+pollreactor_heap_set(struct pollreactor *pr, int pos
+                     , struct pollreactor_timer *timer)
+{
+    pr->timer_heap[pos] = timer;
+    timer->heap_pos = pos;
+}
+
+// Move a timer in the timer heap after its waketime changes
+static void
+pollreactor_heap_update(struct pollreactor *pr, struct pollreactor_timer *timer)
+{
+    struct pollreactor_timer **heap = pr->timer_heap;
+    double waketime = timer->waketime;
+    int pos = timer->heap_pos;
+    while (pos) {
+        int parent = (pos - 1) / 2;
+        if (heap[parent]->waketime <= waketime)
+            break;
+        pollreactor_heap_set(pr, pos, heap[parent]);
+        pos = parent;
+    }
+    for (;;) {
+        int child = 2 * pos + 1;
+        if (child >= pr->num_timers)
+            break;
+        if (child + 1 < pr->num_timers
+            && heap[child + 1]->waketime < heap[child]->waketime)
+            child++;
+        if (waketime <= heap[child]->waketime)
+            break;
+        pollreactor_heap_set(pr, pos, heap[child]);
+        pos = child;
+    }
+    pollreactor_heap_set(pr, pos, timer);
 }
 
 // Add a timer callback
 static void
 pollreactor_add_timer(struct pollreactor *pr, int pos, void *callback)
 {
-    pr->timers[pos].callback = callback;
-    pr->timers[pos].waketime = PR_NEVER;
+    struct pollreactor_timer *timer = &pr->timers[pos];
+    timer->callback = callback;
+    timer->waketime = PR_NEVER;
+    pollreactor_heap_update(pr, timer);
 }
 
 // Return the last schedule wake-up time for a timer
@@ -115,68 +261,138 @@ pollreactor_get_timer(struct pollreactor *pr, int pos)
 static void
 pollreactor_update_timer(struct pollreactor *pr, int pos, double waketime)
 {
-    pr->timers[pos].waketime = waketime;
-    if (waketime < pr->next_timer)
-        pr->next_timer = waketime;
+    struct pollreactor_timer *timer = &pr->timers[pos];
+    timer->waketime = waketime;
+    pollreactor_heap_update(pr, timer);
 }
 
-// Internal code to invoke timer callbacks
-static int
+// Internal code to invoke timer callbacks - returns the time of the
+// next timer event
+static double
 pollreactor_check_timers(struct pollreactor *pr, double eventtime)
 {
-    if (eventtime >= pr->next_timer) {
-        pr->next_timer = PR_NEVER;
-        int i;
-        for (i=0; i<pr->num_timers; i++) {
-            struct pollreactor_timer *timer = &pr->timers[i];
-            double t = timer->waketime;
-            if (eventtime >= t) {
-                t = timer->callback(pr->callback_data, eventtime);
-                timer->waketime = t;
-            }
-            if (t < pr->next_timer)
-                pr->next_timer = t;
-        }
-        if (eventtime >= pr->next_timer)
-            return 0;
-    }
-    double timeout = ceil((pr->next_timer - eventtime) * 1000.);
-    return timeout < 1. ? 1 : (timeout > 1000. ? 1000 : (int)timeout);
-}
-
-// Repeatedly check for timer and fd events and invoke their callbacks
-static void
-pollreactor_run(struct pollreactor *pr)
-{
-    double eventtime = get_monotonic();
-    while (! pr->must_exit) {
-        int timeout = pollreactor_check_timers(pr, eventtime);
-        int ret = poll(pr->fds, pr->num_fds, timeout);
-        eventtime = get_monotonic();
-        if (ret > 0) {
-            int i;
-            for (i=0; i<pr->num_fds; i++)
-                if (pr->fds[i].revents)
-                    pr->fd_callbacks[i](pr->callback_data, eventtime);
-        } else if (ret < 0) {
-            report_errno("poll", ret);
-            pr->must_exit = 1;
-        }
+    // Each due timer is invoked at most once per call (a timer that
+    // reschedules itself in the past is run on the next call)
+    int count = pr->num_timers;
+    while (count--) {
+        struct pollreactor_timer *timer = pr->timer_heap[0];
+        if (eventtime < timer->waketime)
+            break;
+        timer->waketime = timer->callback(pr->callback_data, eventtime);
+        pollreactor_heap_update(pr, timer);
     }
+    return pr->timer_heap[0]->waketime;
 }
 
 // Request that a currently running pollreactor_run() loop exit
 static void
 pollreactor_do_exit(struct pollreactor *pr)
 {
-    pr->must_exit = 1;
+    __atomic_store_n(&pr->must_exit, 1, __ATOMIC_SEQ_CST);
 }
 
 // Check if a pollreactor_run() loop has been requested to exit
 static int
 pollreactor_is_exit(struct pollreactor *pr)
 {
-    return pr->must_exit;
+    return __atomic_load_n(&pr->must_exit, __ATOMIC_SEQ_CST);
+}
+
+// Wait for fd events using poll() and invoke their callbacks
+static double
+pollreactor_wait_poll(struct pollreactor *pr, double eventtime
+                      , double waketime)
+{
+    int timeout = 0;
+    if (eventtime < waketime) {
+        double t = ceil((waketime - eventtime) * 1000.);
+        timeout = t < 1. ? 1 : (t > 1000. ? 1000 : (int)t);
+    }
+    int ret = poll(pr->fds, pr->num_fds, timeout);
+    eventtime = get_monotonic();
+    if (ret > 0) {
+        int i;
+        for (i=0; i<pr->num_fds; i++) {
+            short revents = pr->fds[i].revents;
+            if (revents)
+                pollreactor_fd_event(
+                    pr, i, revents & ~POLLOUT
+                    , revents & (POLLOUT|POLLERR|POLLHUP), eventtime);
+        }
+    } else if (ret < 0) {
+        report_errno("poll", ret);
+        pollreactor_do_exit(pr);
+    }
+    return eventtime;
+}
+
+// Wait for fd and timerfd events using epoll and invoke the fd callbacks
+static double
+pollreactor_wait_epoll(struct pollreactor *pr, double eventtime
+                       , double waketime)
+{
+    int timeout = 0;
+    if (eventtime < waketime) {
+        // Wake at least once a second
+        timeout = 1000;
+        if (waketime < eventtime + 1. && waketime != pr->timer_fd_waketime) {
+            // Arm the timerfd relative to the current time (the
+            // get_monotonic() clock is not available to timerfd)
+            double delay = waketime - get_monotonic();
+            if (delay < 0.000001)
+                delay = 0.000001;
+            struct itimerspec its = {
+                .it_value.tv_sec = (time_t)delay,
+                .it_value.tv_nsec = (delay - (time_t)delay) * 1000000000.,
+            };
+            int ret = timerfd_settime(pr->timer_fd, 0, &its, NULL);
+            if (ret < 0)
+                report_errno("timerfd_settime", ret);
+            pr->timer_fd_waketime = waketime;
+        }
+    }
+    struct epoll_event events[pr->num_fds + 1];
+    int ret = epoll_wait(pr->epoll_fd, events, pr->num_fds + 1, timeout);
+    eventtime = get_monotonic();
+    if (ret < 0) {
+        if (errno == EINTR)
+            return eventtime;
+        report_errno("epoll_wait", ret);
+        pollreactor_do_exit(pr);
+        return eventtime;
+    }
+    int i;
+    for (i=0; i<ret; i++) {
+        int pos = events[i].data.u32;
+        if (pos < pr->num_fds) {
+            uint32_t revents = events[i].events;
+            pollreactor_fd_event(
+                pr, pos, revents & ~EPOLLOUT
+                , revents & (EPOLLOUT|EPOLLERR|EPOLLHUP), eventtime);
+            continue;
+        }
+        // Timerfd expired - it must be rearmed for the next timer
+        uint64_t expirations;
+        int rret = read(pr->timer_fd, &expirations, sizeof(expirations));
+        if (rret < 0 && errno != EAGAIN)
+            report_errno("timerfd read", rret);
+        pr->timer_fd_waketime = PR_NEVER;
+    }
+    return eventtime;
+}
+
+// Repeatedly check for timer and fd events and invoke their callbacks
+static void
+pollreactor_run(struct pollreactor *pr)
+{
+    double eventtime = get_monotonic();
+    while (! pollreactor_is_exit(pr)) {
+        double waketime = pollreactor_check_timers(pr, eventtime);
+        if (pr->epoll_fd >= 0)
+            eventtime = pollreactor_wait_epoll(pr, eventtime, waketime);
+        else
+            eventtime = pollreactor_wait_poll(pr, eventtime, waketime);
+    }
 }
 
 static int
@@ -196,6 +412,64 @@ set_non_blocking(int fd)
 }
 
 
+/****************************************************************
+ * Transport backends
+ ****************************************************************/
+
+// A transport backend performs the low-level io on the file
+// descriptor used to communicate with the mcu.  The retransmit and
+// scheduling code only accesses the mcu through these callbacks.
+struct sq_transport {
+    char type;
+    int (*read)(int fd, void *buf, int len);
+    int (*writev)(int fd, const struct iovec *iov, int count);
+    int (*flush_output)(int fd);
+};
+
+static int
+fd_read(int fd, void *buf, int len)
+{
+    return read(fd, buf, len);
+}
+
+static int
+fd_writev(int fd, const struct iovec *iov, int count)
+{
+    return writev(fd, iov, count);
+}
+
+// Discard data not yet transmitted by the kernel tty layer
+static int
+tty_flush_output(int fd)
+{
+    return tcflush(fd, TCOFLUSH);
+}
+
+static int
+fd_flush_output(int fd)
+{
+    return 0;
+}
+
+static const struct sq_transport sq_transports[] = {
+    // Serial ports, USB-CDC devices, and ptys
+    { SQT_TTY, fd_read, fd_writev, tty_flush_output },
+    // Regular files, pipes, and sockets
+    { SQT_FD, fd_read, fd_writev, fd_flush_output },
+};
+
+// Find the transport backend for a given type code
+static const struct sq_transport *
+transport_lookup(char type)
+{
+    int i;
+    for (i=0; i<ARRAY_SIZE(sq_transports); i++)
+        if (sq_transports[i].type == type)
+            return &sq_transports[i];
+    return NULL;
+}
+
+
 /****************************************************************
  * Serial protocol helpers
  ****************************************************************/
@@ -271,20 +545,83 @@ f4: *p++ = v & 0x7f;
 }
 
 
+/****************************************************************
+ * Lock-free thread handoff
+ ****************************************************************/
+
+// A 'handoff' passes items from one thread to another without taking
+// a lock.  The producer pushes onto a singly linked stack using an
+// atomic compare-and-swap and the consumer atomically takes the whole
+// stack at once.  The consumer then owns the items and may place them
+// on regular lists.
+
+// Atomically push an item onto a handoff stack
+static void
+handoff_push(struct list_node **head, struct list_node *n)
+{
+    struct list_node *old = __atomic_load_n(head, __ATOMIC_RELAXED);
+    do {
+        n->next = old;
+    } while (!__atomic_compare_exchange_n(head, &old, n, 1, __ATOMIC_SEQ_CST
+                                          , __ATOMIC_RELAXED));
+}
+
+// Check if a handoff stack is empty
+static int
+handoff_empty(struct list_node **head)
+{
+    return !__atomic_load_n(head, __ATOMIC_SEQ_CST);
+}
+
+// Remove all items from a handoff stack and add them to the tail of
+// 'root' in the order they were pushed
+static void
+handoff_take(struct list_node **head, struct list_head *root)
+{
+    struct list_node *n = __atomic_exchange_n(head, NULL, __ATOMIC_SEQ_CST);
+    struct list_node *pos = &root->root;
+    while (n) {
+        struct list_node *next = n->next;
+        list_add_before(n, pos);
+        pos = n;
+        n = next;
+    }
+}
+
+
 /****************************************************************
  * Command queues
  ****************************************************************/
 
+// Position of a command_queue in a 'struct queue_heap'
+struct heap_node {
+    uint64_t clock;
+    int pos;
+};
+
 struct command_queue {
     struct list_head stalled_queue, ready_queue;
-    struct list_node node;
+    struct heap_node stalled_hn, ready_hn;
+    // Batches still in the serialqueue send_handoff (atomic)
+    int pending_batches;
+    // Stats (protected by the serialqueue lock)
+    struct command_queue_stats stats;
 };
 
 // Allocate a 'struct queue_message' object
 static struct queue_message *
 message_alloc(void)
 {
-    struct queue_message *qm = malloc(sizeof(*qm));
+    struct queue_message *qm = malloc(sizeof(*qm) + MESSAGE_MAX);
+    memset(qm, 0, sizeof(*qm));
+    return qm;
+}
+
+// Allocate a 'struct queue_message' with room for a full message block
+static struct queue_message *
+block_alloc(void)
+{
+    struct queue_message *qm = malloc(sizeof(*qm) + MESSAGE_BLOCK_MAX);
     memset(qm, 0, sizeof(*qm));
     return qm;
 }
@@ -299,11 +636,10 @@ message_fill(uint8_t *data, int len)
     return qm;
 }
 
-// Allocate a queue_message and fill it with a series of encoded vlq integers
-struct queue_message *
-message_alloc_and_encode(uint32_t *data, int len)
+// Fill a queue_message with a series of encoded vlq integers
+static void
+message_encode(struct queue_message *qm, uint32_t *data, int len)
 {
-    struct queue_message *qm = message_alloc();
     int i;
     uint8_t *p = qm->msg;
     for (i=0; i<len; i++) {
@@ -312,11 +648,86 @@ message_alloc_and_encode(uint32_t *data, int len)
             goto fail;
     }
     qm->len = p - qm->msg;
-    return qm;
+    return;
 
 fail:
     errorf("Encode error");
     qm->len = 0;
+}
+
+// Allocate a queue_message and fill it with a series of encoded vlq integers
+struct queue_message *
+message_alloc_and_encode(uint32_t *data, int len)
+{
+    struct queue_message *qm = message_alloc();
+    message_encode(qm, data, len);
+    return qm;
+}
+
+// A message arena hands out the messages of a single producer (such
+// as a stepcompress object) from large chunks, which avoids a malloc()
+// and free() for every message.  A chunk is freed (from whichever
+// thread releases it last) once all of its messages are freed.
+#define ARENA_CHUNK_MESSAGES 256
+#define ARENA_MESSAGE_SIZE ((sizeof(struct queue_message) + MESSAGE_MAX + 7) \
+                            & ~7)
+
+struct message_chunk {
+    int refcount; // atomic
+    uint8_t data[] __aligned(8);
+};
+
+struct message_arena {
+    struct message_chunk *chunk;
+    int pos;
+};
+
+// Drop references to a chunk and free it if it is no longer in use
+static void
+message_chunk_put(struct message_chunk *mc, int count)
+{
+    if (!__atomic_sub_fetch(&mc->refcount, count, __ATOMIC_ACQ_REL))
+        free(mc);
+}
+
+// Allocate a 'struct message_arena' object
+struct message_arena *
+message_arena_alloc(void)
+{
+    struct message_arena *ma = malloc(sizeof(*ma));
+    memset(ma, 0, sizeof(*ma));
+    return ma;
+}
+
+// Free an arena (messages allocated from it remain valid until freed)
+void
+message_arena_free(struct message_arena *ma)
+{
+    if (!ma)
+        return;
+    if (ma->chunk)
+        message_chunk_put(ma->chunk, ARENA_CHUNK_MESSAGES - ma->pos);
+    free(ma);
+}
+
+// Allocate a queue_message from an arena and fill it with a series
+// of encoded vlq integers
+struct queue_message *
+message_arena_encode(struct message_arena *ma, uint32_t *data, int len)
+{
+    struct message_chunk *mc = ma->chunk;
+    if (!mc || ma->pos >= ARENA_CHUNK_MESSAGES) {
+        // Each message of the new chunk holds a reference to it
+        mc = malloc(sizeof(*mc) + ARENA_CHUNK_MESSAGES * ARENA_MESSAGE_SIZE);
+        mc->refcount = ARENA_CHUNK_MESSAGES;
+        ma->chunk = mc;
+        ma->pos = 0;
+    }
+    struct queue_message *qm = (void*)&mc->data[ma->pos * ARENA_MESSAGE_SIZE];
+    ma->pos++;
+    memset(qm, 0, sizeof(*qm));
+    qm->chunk = mc;
+    message_encode(qm, data, len);
     return qm;
 }
 
@@ -324,7 +735,10 @@ fail:
 static void
 message_free(struct queue_message *qm)
 {
-    free(qm);
+    if (qm->chunk)
+        message_chunk_put(qm->chunk, 1);
+    else
+        free(qm);
 }
 
 // Free all the messages on a queue
@@ -340,6 +754,116 @@ message_queue_free(struct list_head *root)
 }
 
 
+/****************************************************************
+ * Command queue heaps
+ ****************************************************************/
+
+// A binary min-heap of command queues keyed on the clock of the
+// message at the head of one of their queues.  This allows the
+// background thread to find the next message to transmit without
+// scanning every command_queue.
+struct queue_heap {
+    struct heap_node **nodes;
+    int count, size;
+};
+
+// Move a node towards the root of the heap until its parent is not
+// later than it
+static void
+heap_sift_up(struct queue_heap *h, struct heap_node *hn)
+{
+    int pos = hn->pos;
+    while (pos) {
+        int parent_pos = (pos - 1) / 2;
+        struct heap_node *parent = h->nodes[parent_pos];
+        if (parent->clock <= hn->clock)
+            break;
+        h->nodes[pos] = parent;
+        parent->pos = pos;
+        pos = parent_pos;
+    }
+    h->nodes[pos] = hn;
+    hn->pos = pos;
+}
+
+// Move a node away from the root of the heap until its children are
+// not earlier than it
+static void
+heap_sift_down(struct queue_heap *h, struct heap_node *hn)
+{
+    int pos = hn->pos, count = h->count;
+    for (;;) {
+        int child_pos = 2*pos + 1;
+        if (child_pos >= count)
+            break;
+        struct heap_node *child = h->nodes[child_pos];
+        if (child_pos + 1 < count
+            && h->nodes[child_pos + 1]->clock < child->clock)
+            child = h->nodes[++child_pos];
+        if (hn->clock <= child->clock)
+            break;
+        h->nodes[pos] = child;
+        child->pos = pos;
+        pos = child_pos;
+    }
+    h->nodes[pos] = hn;
+    hn->pos = pos;
+}
+
+// Add, reorder, or remove a node so that it is in the heap with the
+// given clock ('in_heap' set) or not in the heap ('in_heap' clear)
+static void
+heap_update(struct queue_heap *h, struct heap_node *hn, int in_heap
+            , uint64_t clock)
+{
+    if (!in_heap) {
+        if (hn->pos < 0)
+            return;
+        struct heap_node *last = h->nodes[--h->count];
+        if (last != hn) {
+            last->pos = hn->pos;
+            if (last->clock < hn->clock)
+                heap_sift_up(h, last);
+            else
+                heap_sift_down(h, last);
+        }
+        hn->pos = -1;
+        return;
+    }
+    if (hn->pos < 0) {
+        if (h->count >= h->size) {
+            h->size = h->size ? 2 * h->size : 16;
+            h->nodes = realloc(h->nodes, h->size * sizeof(*h->nodes));
+        }
+        hn->pos = h->count++;
+        hn->clock = clock;
+        heap_sift_up(h, hn);
+        return;
+    }
+    uint64_t old_clock = hn->clock;
+    hn->clock = clock;
+    if (clock < old_clock)
+        heap_sift_up(h, hn);
+    else if (clock > old_clock)
+        heap_sift_down(h, hn);
+}
+
+// Return the node with the earliest clock (or NULL if heap empty)
+static struct heap_node *
+heap_first(struct queue_heap *h)
+{
+    return h->count ? h->nodes[0] : NULL;
+}
+
+// A batch of messages from serialqueue_send_batch() for a command_queue
+struct command_batch {
+    struct list_node node;
+    struct command_queue *cq;
+    struct list_head msgs;
+    int len;
+};
+
+
 /****************************************************************
  * Serialqueue interface
  ****************************************************************/
@@ -348,17 +872,21 @@ struct serialqueue {
     // Input reading
     struct pollreactor pr;
     int serial_fd;
+    const struct sq_transport *transport;
     int pipe_fds[2];
     uint8_t input_buf[4096];
     uint8_t need_sync;
     int input_pos;
     // Threading
     pthread_t tid;
-    pthread_mutex_t lock; // protects variables below
+    struct list_node *send_handoff, *receive_handoff;
+    pthread_mutex_t receive_lock; // protects variables below
     pthread_cond_t cond;
     int receive_waiting;
+    struct list_head old_receive;
+    pthread_mutex_t lock; // protects variables below
     // Baud / clock tracking
-    int receive_window;
+    int receive_window, block_max;
     double baud_adjust, idle_time;
     double est_freq, last_clock_time;
     uint64_t last_clock;
@@ -369,16 +897,22 @@ struct serialqueue {
     struct list_head sent_queue;
     double srtt, rttvar, rto;
     // Pending transmission message queues
-    struct list_head pending_queues;
+    struct queue_heap stalled_heap, ready_heap;
+    int ready_background;
     int ready_bytes, stalled_bytes, need_ack_bytes, last_ack_bytes;
-    uint64_t need_kick_clock;
+    uint64_t need_kick_clock; // also read by serialqueue_send_batch()
     struct list_head notify_queue;
-    // Received messages
+    // Output the serial port has not accepted yet
+    uint8_t output_buf[MESSAGE_BLOCK_MAX * MESSAGE_SEQ_MASK + 1];
+    int output_pos, output_len, output_retransmit;
+    // Received messages (only accessed from serialqueue_pull())
     struct list_head receive_queue;
     // Debugging
-    struct list_head old_sent, old_receive;
+    struct list_head old_sent;
     // Stats
     uint32_t bytes_write, bytes_read, bytes_retransmit, bytes_invalid;
+    uint32_t write_calls, short_writes, retransmits;
+    struct sq_histogram ack_time;
 };
 
 #define SQPF_SERIAL 0
@@ -420,14 +954,62 @@ debug_queue_add(struct list_head *root, struct queue_message *qm)
     message_free(old);
 }
 
+// Add a duration (in seconds) to a histogram
+static void
+histogram_add(struct sq_histogram *h, double time)
+{
+    int bucket = 0;
+    if (time >= SQ_HIST_BASE_TIME) {
+        bucket = ilogb(time / SQ_HIST_BASE_TIME) + 1;
+        if (bucket >= SQ_HIST_SIZE)
+            bucket = SQ_HIST_SIZE - 1;
+    }
+    h->buckets[bucket]++;
+    h->count++;
+    h->sum += time;
+}
+
+// Update the position of a command_queue in the stalled_heap after
+// the head of its stalled_queue changes
+static void
+update_stalled_heap(struct serialqueue *sq, struct command_queue *cq)
+{
+    uint64_t min_clock = 0;
+    int in_heap = !list_empty(&cq->stalled_queue);
+    if (in_heap)
+        min_clock = list_first_entry(
+            &cq->stalled_queue, struct queue_message, node)->min_clock;
+    heap_update(&sq->stalled_heap, &cq->stalled_hn, in_heap, min_clock);
+}
+
+// Update the position of a command_queue in the ready_heap after the
+// head of its ready_queue changes
+static void
+update_ready_heap(struct serialqueue *sq, struct command_queue *cq)
+{
+    struct heap_node *hn = &cq->ready_hn;
+    if (hn->pos >= 0 && hn->clock == BACKGROUND_PRIORITY_CLOCK)
+        sq->ready_background--;
+    uint64_t req_clock = 0;
+    int in_heap = !list_empty(&cq->ready_queue);
+    if (in_heap) {
+        req_clock = list_first_entry(
+            &cq->ready_queue, struct queue_message, node)->req_clock;
+        if (req_clock == BACKGROUND_PRIORITY_CLOCK)
+            sq->ready_background++;
+    }
+    heap_update(&sq->ready_heap, hn, in_heap, req_clock);
+}
+
 // Wake up the receiver thread if it is waiting
 static void
 check_wake_receive(struct serialqueue *sq)
 {
-    if (sq->receive_waiting) {
-        sq->receive_waiting = 0;
-        pthread_cond_signal(&sq->cond);
-    }
+    if (!__atomic_load_n(&sq->receive_waiting, __ATOMIC_SEQ_CST))
+        return;
+    pthread_mutex_lock(&sq->receive_lock);
+    pthread_cond_signal(&sq->cond);
+    pthread_mutex_unlock(&sq->receive_lock);
 }
 
 // Write to the internal pipe to wake the background thread if in poll
@@ -456,6 +1038,9 @@ update_receive_seq(struct serialqueue *sq, double eventtime, uint64_t rseq)
         }
         sq->need_ack_bytes -= sent->len;
         list_del(&sent->node);
+        if (sent_seq >= sq->retransmit_seq)
+            // Block was only transmitted once - record time to its ack
+            histogram_add(&sq->ack_time, eventtime - sent->sent_time);
         debug_queue_add(&sq->old_sent, sent);
         sent_seq++;
         if (rseq == sent_seq) {
@@ -527,7 +1112,7 @@ handle_message(struct serialqueue *sq, double eventtime, int len)
         qm->len = 0;
         qm->sent_time = sq->last_receive_sent_time;
         qm->receive_time = eventtime;
-        list_add_tail(&qm->node, &sq->receive_queue);
+        handoff_push(&sq->receive_handoff, &qm->node);
         must_wake = 1;
     }
 
@@ -546,7 +1131,7 @@ handle_message(struct serialqueue *sq, double eventtime, int len)
                          ? sq->last_receive_sent_time : 0.);
         qm->receive_time = get_monotonic(); // must be time post read()
         qm->receive_time -= sq->baud_adjust * len;
-        list_add_tail(&qm->node, &sq->receive_queue);
+        handoff_push(&sq->receive_handoff, &qm->node);
         must_wake = 1;
     }
 
@@ -558,8 +1143,8 @@ handle_message(struct serialqueue *sq, double eventtime, int len)
 static void
 input_event(struct serialqueue *sq, double eventtime)
 {
-    int ret = read(sq->serial_fd, &sq->input_buf[sq->input_pos]
-                   , sizeof(sq->input_buf) - sq->input_pos);
+    int ret = sq->transport->read(sq->serial_fd, &sq->input_buf[sq->input_pos]
+                                  , sizeof(sq->input_buf) - sq->input_pos);
     if (ret <= 0) {
         report_errno("read", ret);
         pollreactor_do_exit(&sq->pr);
@@ -601,18 +1186,131 @@ kick_event(struct serialqueue *sq, double eventtime)
     pollreactor_update_timer(&sq->pr, SQPT_COMMAND, PR_NOW);
 }
 
+// Account for 'count' bytes of output accepted by the serial port
+static void
+output_sent(struct serialqueue *sq, double eventtime, int count
+            , int is_retransmit)
+{
+    if (is_retransmit)
+        sq->bytes_retransmit += count;
+    else
+        sq->bytes_write += count;
+    if (eventtime > sq->idle_time)
+        sq->idle_time = eventtime;
+    sq->idle_time += count * sq->baud_adjust;
+    sq->need_ack_bytes += count;
+}
+
+// Discard output the serial port has not accepted yet
+static void
+output_discard(struct serialqueue *sq)
+{
+    sq->output_pos = sq->output_len = 0;
+    pollreactor_set_write_fd(&sq->pr, SQPF_SERIAL, sq->serial_fd, NULL);
+}
+
+// Callback for when the serial port can accept pending output
+static void
+output_event(struct serialqueue *sq, double eventtime)
+{
+    pthread_mutex_lock(&sq->lock);
+    if (!sq->output_len) {
+        output_discard(sq);
+        pthread_mutex_unlock(&sq->lock);
+        return;
+    }
+    struct iovec iov = { .iov_base = &sq->output_buf[sq->output_pos]
+                         , .iov_len = sq->output_len };
+    int ret = sq->transport->writev(sq->serial_fd, &iov, 1);
+    if (!sq->output_retransmit)
+        sq->write_calls++;
+    if (ret < 0) {
+        if (errno != EAGAIN && errno != EINTR) {
+            // The blocks stay in sent_queue for a retransmit
+            report_errno("writev", ret);
+            output_discard(sq);
+            pollreactor_update_timer(&sq->pr, SQPT_COMMAND, PR_NOW);
+        }
+        pthread_mutex_unlock(&sq->lock);
+        return;
+    }
+    output_sent(sq, eventtime, ret, sq->output_retransmit);
+    sq->output_pos += ret;
+    sq->output_len -= ret;
+    if (!sq->output_len) {
+        // All output sent - new blocks may be transmitted again
+        output_discard(sq);
+        pollreactor_update_timer(&sq->pr, SQPT_COMMAND, PR_NOW);
+    }
+    pthread_mutex_unlock(&sq->lock);
+}
+
+// Send a series of blocks to the serial port with a single syscall.
+// The idle_time and need_ack_bytes of the blocks must already be
+// accounted for - any part the (non-blocking) port does not accept is
+// removed from them again and kept for output_event().
+static void
+send_commands(struct serialqueue *sq, struct iovec *iov, int count
+              , int is_retransmit)
+{
+    int len = 0, i;
+    for (i=0; i<count; i++)
+        len += iov[i].iov_len;
+    int ret = sq->transport->writev(sq->serial_fd, iov, count);
+    int keep_unsent = 1;
+    if (ret < 0) {
+        if (errno != EAGAIN && errno != EINTR) {
+            // The blocks stay in sent_queue for a retransmit
+            report_errno("writev", ret);
+            keep_unsent = 0;
+        }
+        ret = 0;
+    }
+    if (is_retransmit) {
+        sq->bytes_retransmit += ret;
+    } else {
+        sq->bytes_write += ret;
+        sq->write_calls++;
+    }
+    int unsent = len - ret;
+    if (!unsent)
+        return;
+    sq->short_writes++;
+    sq->idle_time -= unsent * sq->baud_adjust;
+    sq->need_ack_bytes -= unsent;
+    if (!keep_unsent)
+        return;
+    int skip = ret;
+    for (i=0; i<count; i++) {
+        int iov_len = iov[i].iov_len;
+        if (skip >= iov_len) {
+            skip -= iov_len;
+            continue;
+        }
+        memcpy(&sq->output_buf[sq->output_len]
+               , (uint8_t*)iov[i].iov_base + skip, iov_len - skip);
+        sq->output_len += iov_len - skip;
+        skip = 0;
+    }
+    sq->output_retransmit = is_retransmit;
+    pollreactor_set_write_fd(&sq->pr, SQPF_SERIAL, sq->serial_fd
+                             , output_event);
+}
+
 // Callback timer for when a retransmit should be done
 static double
 retransmit_event(struct serialqueue *sq, double eventtime)
 {
-    int ret = tcflush(sq->serial_fd, TCOFLUSH);
+    int ret = sq->transport->flush_output(sq->serial_fd);
     if (ret < 0)
-        report_errno("tcflush", ret);
+        report_errno("flush output", ret);
 
     pthread_mutex_lock(&sq->lock);
+    // Output not yet accepted by the port is part of the retransmit
+    output_discard(sq);
 
     // Retransmit all pending messages
-    uint8_t buf[MESSAGE_MAX * MESSAGE_SEQ_MASK + 1];
+    uint8_t buf[MESSAGE_BLOCK_MAX * MESSAGE_SEQ_MASK + 1];
     int buflen = 0, first_buflen = 0;
     buf[buflen++] = MESSAGE_SYNC;
     struct queue_message *qm;
@@ -622,10 +1320,11 @@ retransmit_event(struct serialqueue *sq, double eventtime)
         if (!first_buflen)
             first_buflen = qm->len + 1;
     }
-    ret = write(sq->serial_fd, buf, buflen);
-    if (ret < 0)
-        report_errno("retransmit write", ret);
-    sq->bytes_retransmit += buflen;
+    sq->idle_time = eventtime + buflen * sq->baud_adjust;
+    sq->need_ack_bytes = buflen - 1;
+    struct iovec iov = { .iov_base = buf, .iov_len = buflen };
+    send_commands(sq, &iov, 1, 1);
+    sq->retransmits++;
 
     // Update rto
     if (pollreactor_get_timer(&sq->pr, SQPT_RETRANSMIT) == PR_NOW) {
@@ -643,45 +1342,35 @@ retransmit_event(struct serialqueue *sq, double eventtime)
     }
     sq->retransmit_seq = sq->send_seq;
     sq->rtt_sample_seq = 0;
-    sq->idle_time = eventtime + buflen * sq->baud_adjust;
     double waketime = eventtime + first_buflen * sq->baud_adjust + sq->rto;
 
     pthread_mutex_unlock(&sq->lock);
     return waketime;
 }
 
-// Construct a block of data and send to the serial port
-static void
-build_and_send_command(struct serialqueue *sq, double eventtime)
+// Construct a block of data to send to the serial port
+static struct queue_message *
+build_command(struct serialqueue *sq, double eventtime)
 {
-    struct queue_message *out = message_alloc();
+    struct queue_message *out = block_alloc();
     out->len = MESSAGE_HEADER_SIZE;
 
     while (sq->ready_bytes) {
         // Find highest priority message (message with lowest req_clock)
-        uint64_t min_clock = MAX_CLOCK;
-        struct command_queue *q, *cq = NULL;
-        struct queue_message *qm = NULL;
-        list_for_each_entry(q, &sq->pending_queues, node) {
-            if (!list_empty(&q->ready_queue)) {
-                struct queue_message *m = list_first_entry(
-                    &q->ready_queue, struct queue_message, node);
-                if (m->req_clock < min_clock) {
-                    min_clock = m->req_clock;
-                    cq = q;
-                    qm = m;
-                }
-            }
-        }
+        struct command_queue *cq = container_of(
+            heap_first(&sq->ready_heap), struct command_queue, ready_hn);
+        struct queue_message *qm = list_first_entry(
+            &cq->ready_queue, struct queue_message, node);
         // Append message to outgoing command
-        if (out->len + qm->len > sizeof(out->msg) - MESSAGE_TRAILER_SIZE)
+        if (out->len + qm->len > sq->block_max - MESSAGE_TRAILER_SIZE)
             break;
         list_del(&qm->node);
-        if (list_empty(&cq->ready_queue) && list_empty(&cq->stalled_queue))
-            list_del(&cq->node);
+        update_ready_heap(sq, cq);
         memcpy(&out->msg[out->len], qm->msg, qm->len);
         out->len += qm->len;
         sq->ready_bytes -= qm->len;
+        cq->stats.bytes += qm->len;
+        histogram_add(&cq->stats.queue_time, eventtime - qm->queue_time);
         if (qm->notify_id) {
             // Message requires notification - add to notify list
             qm->req_clock = sq->send_seq;
@@ -701,11 +1390,7 @@ build_and_send_command(struct serialqueue *sq, double eventtime)
     out->msg[out->len - MESSAGE_TRAILER_CRC+1] = crc & 0xff;
     out->msg[out->len - MESSAGE_TRAILER_SYNC] = MESSAGE_SYNC;
 
-    // Send message
-    int ret = write(sq->serial_fd, out->msg, out->len);
-    if (ret < 0)
-        report_errno("write", ret);
-    sq->bytes_write += out->len;
+    // Update state as if the message was sent
     if (eventtime > sq->idle_time)
         sq->idle_time = eventtime;
     sq->idle_time += out->len * sq->baud_adjust;
@@ -719,6 +1404,7 @@ build_and_send_command(struct serialqueue *sq, double eventtime)
     sq->send_seq++;
     sq->need_ack_bytes += out->len;
     list_add_tail(&out->node, &sq->sent_queue);
+    return out;
 }
 
 // Determine the time the next serial data should be sent
@@ -730,7 +1416,7 @@ check_send_command(struct serialqueue *sq, double eventtime)
         // Need an ack before more messages can be sent
         return PR_NEVER;
     if (sq->send_seq > sq->receive_seq && sq->receive_window) {
-        int need_ack_bytes = sq->need_ack_bytes + MESSAGE_MAX;
+        int need_ack_bytes = sq->need_ack_bytes + sq->block_max;
         if (sq->last_ack_seq < sq->receive_seq)
             need_ack_bytes += sq->last_ack_bytes;
         if (need_ack_bytes > sq->receive_window)
@@ -745,44 +1431,51 @@ check_send_command(struct serialqueue *sq, double eventtime)
     uint64_t ack_clock = ((uint64_t)(timedelta * sq->est_freq)
                           + sq->last_clock);
     uint64_t min_stalled_clock = MAX_CLOCK, min_ready_clock = MAX_CLOCK;
-    struct command_queue *cq;
-    list_for_each_entry(cq, &sq->pending_queues, node) {
+    for (;;) {
+        struct heap_node *hn = heap_first(&sq->stalled_heap);
+        if (!hn)
+            break;
+        if (ack_clock < hn->clock) {
+            min_stalled_clock = hn->clock;
+            break;
+        }
         // Move messages from the stalled_queue to the ready_queue
+        struct command_queue *cq = container_of(
+            hn, struct command_queue, stalled_hn);
         while (!list_empty(&cq->stalled_queue)) {
             struct queue_message *qm = list_first_entry(
                 &cq->stalled_queue, struct queue_message, node);
-            if (ack_clock < qm->min_clock) {
-                if (qm->min_clock < min_stalled_clock)
-                    min_stalled_clock = qm->min_clock;
+            if (ack_clock < qm->min_clock)
                 break;
-            }
             list_del(&qm->node);
             list_add_tail(&qm->node, &cq->ready_queue);
             sq->stalled_bytes -= qm->len;
             sq->ready_bytes += qm->len;
+            cq->stats.stalled_bytes -= qm->len;
         }
-        // Update min_ready_clock
-        if (!list_empty(&cq->ready_queue)) {
-            struct queue_message *qm = list_first_entry(
-                &cq->ready_queue, struct queue_message, node);
-            uint64_t req_clock = qm->req_clock;
-            if (req_clock == BACKGROUND_PRIORITY_CLOCK)
-                req_clock = (uint64_t)(
-                    (sq->idle_time - sq->last_clock_time
-                     + MIN_REQTIME_DELTA + MIN_BACKGROUND_DELTA)
-                    * sq->est_freq) + sq->last_clock;
-            if (req_clock < min_ready_clock)
-                min_ready_clock = req_clock;
-        }
+        update_stalled_heap(sq, cq);
+        update_ready_heap(sq, cq);
+    }
+    // Find min_ready_clock
+    struct heap_node *hn = heap_first(&sq->ready_heap);
+    if (hn)
+        min_ready_clock = hn->clock;
+    if (sq->ready_background) {
+        uint64_t req_clock = (uint64_t)(
+            (sq->idle_time - sq->last_clock_time
+             + MIN_REQTIME_DELTA + MIN_BACKGROUND_DELTA)
+            * sq->est_freq) + sq->last_clock;
+        if (req_clock < min_ready_clock)
+            min_ready_clock = req_clock;
     }
 
     // Check for messages to send
-    if (sq->ready_bytes >= MESSAGE_PAYLOAD_MAX)
+    if (sq->ready_bytes >= sq->block_max - MESSAGE_MIN)
         return PR_NOW;
     if (! sq->est_freq) {
         if (sq->ready_bytes)
             return PR_NOW;
-        sq->need_kick_clock = MAX_CLOCK;
+        __atomic_store_n(&sq->need_kick_clock, MAX_CLOCK, __ATOMIC_SEQ_CST);
         return PR_NEVER;
     }
     uint64_t reqclock_delta = MIN_REQTIME_DELTA * sq->est_freq;
@@ -791,22 +1484,73 @@ check_send_command(struct serialqueue *sq, double eventtime)
     uint64_t wantclock = min_ready_clock - reqclock_delta;
     if (min_stalled_clock < wantclock)
         wantclock = min_stalled_clock;
-    sq->need_kick_clock = wantclock;
+    __atomic_store_n(&sq->need_kick_clock, wantclock, __ATOMIC_SEQ_CST);
     return idletime + (wantclock - ack_clock) / sq->est_freq;
 }
 
+// Move message batches from serialqueue_send_batch() to their
+// command queues
+static void
+take_send_batches(struct serialqueue *sq)
+{
+    struct list_head batches;
+    list_init(&batches);
+    handoff_take(&sq->send_handoff, &batches);
+    while (!list_empty(&batches)) {
+        struct command_batch *cb = list_first_entry(
+            &batches, struct command_batch, node);
+        list_del(&cb->node);
+        struct command_queue *cq = cb->cq;
+        int was_empty = list_empty(&cq->stalled_queue);
+        list_join_tail(&cb->msgs, &cq->stalled_queue);
+        if (was_empty)
+            update_stalled_heap(sq, cq);
+        sq->stalled_bytes += cb->len;
+        cq->stats.stalled_bytes += cb->len;
+        __atomic_fetch_sub(&cq->pending_batches, 1, __ATOMIC_SEQ_CST);
+        free(cb);
+    }
+}
+
 // Callback timer to send data to the serial port
 static double
 command_event(struct serialqueue *sq, double eventtime)
 {
     pthread_mutex_lock(&sq->lock);
+    // Gather all the blocks that may be sent now and transmit them
+    // together (the number of unacknowledged blocks is limited by
+    // MESSAGE_SEQ_MASK and the receive_window)
+    struct iovec iov[MESSAGE_SEQ_MASK];
+    int iov_count = 0;
     double waketime;
     for (;;) {
+        if (sq->output_len) {
+            // The serial port is busy - output_event() reschedules
+            // this timer once the pending output has been sent
+            waketime = PR_NEVER;
+            break;
+        }
+        take_send_batches(sq);
         waketime = check_send_command(sq, eventtime);
-        if (waketime != PR_NOW)
+        if (waketime == PR_NOW) {
+            if (iov_count >= ARRAY_SIZE(iov)) {
+                send_commands(sq, iov, iov_count, 0);
+                iov_count = 0;
+                continue;
+            }
+            struct queue_message *out = build_command(sq, eventtime);
+            iov[iov_count].iov_base = out->msg;
+            iov[iov_count].iov_len = out->len;
+            iov_count++;
+            continue;
+        }
+        // A batch may have been submitted before need_kick_clock
+        // was updated - if so, it needs to be checked now
+        if (handoff_empty(&sq->send_handoff))
             break;
-        build_and_send_command(sq, eventtime);
     }
+    if (iov_count)
+        send_commands(sq, iov, iov_count, 0);
     pthread_mutex_unlock(&sq->lock);
     return waketime;
 }
@@ -818,22 +1562,29 @@ background_thread(void *data)
     struct serialqueue *sq = data;
     pollreactor_run(&sq->pr);
 
-    pthread_mutex_lock(&sq->lock);
-    check_wake_receive(sq);
-    pthread_mutex_unlock(&sq->lock);
+    pthread_mutex_lock(&sq->receive_lock);
+    pthread_cond_signal(&sq->cond);
+    pthread_mutex_unlock(&sq->receive_lock);
 
     return NULL;
 }
 
-// Create a new 'struct serialqueue' object
+// Create a new 'struct serialqueue' object communicating over
+// 'serial_fd' using the transport backend 'serial_fd_type'
 struct serialqueue * __visible
-serialqueue_alloc(int serial_fd, int write_only)
+serialqueue_alloc(int serial_fd, char serial_fd_type, int write_only)
 {
+    const struct sq_transport *transport = transport_lookup(serial_fd_type);
+    if (!transport) {
+        errorf("Unknown serial transport '%c'", serial_fd_type);
+        return NULL;
+    }
     struct serialqueue *sq = malloc(sizeof(*sq));
     memset(sq, 0, sizeof(*sq));
 
     // Reactor setup
     sq->serial_fd = serial_fd;
+    sq->transport = transport;
     int ret = pipe(sq->pipe_fds);
     if (ret)
         goto fail;
@@ -859,7 +1610,7 @@ serialqueue_alloc(int serial_fd, int write_only)
 
     // Queues
     sq->need_kick_clock = MAX_CLOCK;
-    list_init(&sq->pending_queues);
+    sq->block_max = MESSAGE_MAX;
     list_init(&sq->sent_queue);
     list_init(&sq->receive_queue);
     list_init(&sq->notify_queue);
@@ -872,6 +1623,9 @@ serialqueue_alloc(int serial_fd, int write_only)
 
     // Thread setup
     ret = pthread_mutex_init(&sq->lock, NULL);
+    if (ret)
+        goto fail;
+    ret = pthread_mutex_init(&sq->receive_lock, NULL);
     if (ret)
         goto fail;
     ret = pthread_cond_init(&sq->cond, NULL);
@@ -908,18 +1662,27 @@ serialqueue_free(struct serialqueue *sq)
     if (!pollreactor_is_exit(&sq->pr))
         serialqueue_exit(sq);
     pthread_mutex_lock(&sq->lock);
+    take_send_batches(sq);
+    handoff_take(&sq->receive_handoff, &sq->receive_queue);
     message_queue_free(&sq->sent_queue);
     message_queue_free(&sq->receive_queue);
     message_queue_free(&sq->notify_queue);
     message_queue_free(&sq->old_sent);
     message_queue_free(&sq->old_receive);
-    while (!list_empty(&sq->pending_queues)) {
-        struct command_queue *cq = list_first_entry(
-            &sq->pending_queues, struct command_queue, node);
-        list_del(&cq->node);
-        message_queue_free(&cq->ready_queue);
+    while (sq->stalled_heap.count) {
+        struct command_queue *cq = container_of(
+            heap_first(&sq->stalled_heap), struct command_queue, stalled_hn);
         message_queue_free(&cq->stalled_queue);
+        update_stalled_heap(sq, cq);
+    }
+    while (sq->ready_heap.count) {
+        struct command_queue *cq = container_of(
+            heap_first(&sq->ready_heap), struct command_queue, ready_hn);
+        message_queue_free(&cq->ready_queue);
+        update_ready_heap(sq, cq);
     }
+    free(sq->stalled_heap.nodes);
+    free(sq->ready_heap.nodes);
     pthread_mutex_unlock(&sq->lock);
     pollreactor_free(&sq->pr);
     free(sq);
@@ -933,16 +1696,20 @@ serialqueue_alloc_commandqueue(void)
     memset(cq, 0, sizeof(*cq));
     list_init(&cq->ready_queue);
     list_init(&cq->stalled_queue);
+    cq->stalled_hn.pos = cq->ready_hn.pos = -1;
     return cq;
 }
 
-// Free a 'struct command_queue'
+// Free a 'struct command_queue' (the queue must not have messages
+// pending in a serialqueue - either because they were all sent or
+// because the serialqueue was freed first)
 void __visible
 serialqueue_free_commandqueue(struct command_queue *cq)
 {
     if (!cq)
         return;
-    if (!list_empty(&cq->ready_queue) || !list_empty(&cq->stalled_queue)) {
+    if (__atomic_load_n(&cq->pending_batches, __ATOMIC_SEQ_CST)
+        || !list_empty(&cq->ready_queue) || !list_empty(&cq->stalled_queue)) {
         errorf("Memory leak! Can't free non-empty commandqueue");
         return;
     }
@@ -955,34 +1722,35 @@ serialqueue_send_batch(struct serialqueue *sq, struct command_queue *cq
                        , struct list_head *msgs)
 {
     // Make sure min_clock is set in list and calculate total bytes
+    double curtime = get_monotonic();
     int len = 0;
     struct queue_message *qm;
     list_for_each_entry(qm, msgs, node) {
         if (qm->min_clock + (1LL<<31) < qm->req_clock
             && qm->req_clock != BACKGROUND_PRIORITY_CLOCK)
             qm->min_clock = qm->req_clock - (1LL<<31);
+        qm->queue_time = curtime;
         len += qm->len;
     }
     if (! len)
         return;
     qm = list_first_entry(msgs, struct queue_message, node);
+    uint64_t min_clock = qm->min_clock;
 
-    // Add list to cq->stalled_queue
-    pthread_mutex_lock(&sq->lock);
-    if (list_empty(&cq->ready_queue) && list_empty(&cq->stalled_queue))
-        list_add_tail(&cq->node, &sq->pending_queues);
-    list_join_tail(msgs, &cq->stalled_queue);
-    sq->stalled_bytes += len;
-    int mustwake = 0;
-    if (qm->min_clock < sq->need_kick_clock) {
-        sq->need_kick_clock = 0;
-        mustwake = 1;
-    }
-    pthread_mutex_unlock(&sq->lock);
+    // Pass the list to the background thread
+    struct command_batch *cb = malloc(sizeof(*cb));
+    cb->cq = cq;
+    cb->len = len;
+    list_init(&cb->msgs);
+    list_join_tail(msgs, &cb->msgs);
+    __atomic_fetch_add(&cq->pending_batches, 1, __ATOMIC_SEQ_CST);
+    handoff_push(&sq->send_handoff, &cb->node);
 
     // Wake the background thread if necessary
-    if (mustwake)
+    if (min_clock < __atomic_load_n(&sq->need_kick_clock, __ATOMIC_SEQ_CST)) {
+        __atomic_store_n(&sq->need_kick_clock, 0, __ATOMIC_SEQ_CST);
         kick_bg_thread(sq);
+    }
 }
 
 // Schedule the transmission of a message on the serial port at a
@@ -1008,15 +1776,23 @@ serialqueue_send(struct serialqueue *sq, struct command_queue *cq, uint8_t *msg
 void __visible
 serialqueue_pull(struct serialqueue *sq, struct pull_queue_message *pqm)
 {
-    pthread_mutex_lock(&sq->lock);
     // Wait for message to be available
-    while (list_empty(&sq->receive_queue)) {
-        if (pollreactor_is_exit(&sq->pr))
-            goto exit;
-        sq->receive_waiting = 1;
-        int ret = pthread_cond_wait(&sq->cond, &sq->lock);
-        if (ret)
-            report_errno("pthread_cond_wait", ret);
+    for (;;) {
+        if (list_empty(&sq->receive_queue))
+            handoff_take(&sq->receive_handoff, &sq->receive_queue);
+        if (!list_empty(&sq->receive_queue))
+            break;
+        pthread_mutex_lock(&sq->receive_lock);
+        __atomic_store_n(&sq->receive_waiting, 1, __ATOMIC_SEQ_CST);
+        if (handoff_empty(&sq->receive_handoff)) {
+            if (pollreactor_is_exit(&sq->pr))
+                goto exit;
+            int ret = pthread_cond_wait(&sq->cond, &sq->receive_lock);
+            if (ret)
+                report_errno("pthread_cond_wait", ret);
+        }
+        __atomic_store_n(&sq->receive_waiting, 0, __ATOMIC_RELAXED);
+        pthread_mutex_unlock(&sq->receive_lock);
     }
 
     // Remove message from queue
@@ -1030,17 +1806,19 @@ serialqueue_pull(struct serialqueue *sq, struct pull_queue_message *pqm)
     pqm->sent_time = qm->sent_time;
     pqm->receive_time = qm->receive_time;
     pqm->notify_id = qm->notify_id;
-    if (qm->len)
+    if (qm->len) {
+        pthread_mutex_lock(&sq->receive_lock);
         debug_queue_add(&sq->old_receive, qm);
-    else
+        pthread_mutex_unlock(&sq->receive_lock);
+    } else {
         message_free(qm);
-
-    pthread_mutex_unlock(&sq->lock);
+    }
     return;
 
 exit:
+    __atomic_store_n(&sq->receive_waiting, 0, __ATOMIC_RELAXED);
     pqm->len = -1;
-    pthread_mutex_unlock(&sq->lock);
+    pthread_mutex_unlock(&sq->receive_lock);
 }
 
 void __visible
@@ -1059,6 +1837,20 @@ serialqueue_set_receive_window(struct serialqueue *sq, int receive_window)
     pthread_mutex_unlock(&sq->lock);
 }
 
+// Set the maximum size of message blocks sent to the mcu (if it
+// supports blocks larger than MESSAGE_MAX)
+void __visible
+serialqueue_set_block_max(struct serialqueue *sq, int block_max)
+{
+    if (block_max < MESSAGE_MAX)
+        block_max = MESSAGE_MAX;
+    else if (block_max > MESSAGE_BLOCK_MAX)
+        block_max = MESSAGE_BLOCK_MAX;
+    pthread_mutex_lock(&sq->lock);
+    sq->block_max = block_max;
+    pthread_mutex_unlock(&sq->lock);
+}
+
 // Set the estimated clock rate of the mcu on the other end of the
 // serial port
 void __visible
@@ -1078,6 +1870,8 @@ serialqueue_get_stats(struct serialqueue *sq, char *buf, int len)
 {
     struct serialqueue stats;
     pthread_mutex_lock(&sq->lock);
+    // Include batches not yet taken from the send_handoff
+    take_send_batches(sq);
     memcpy(&stats, sq, sizeof(stats));
     pthread_mutex_unlock(&sq->lock);
 
@@ -1085,13 +1879,40 @@ serialqueue_get_stats(struct serialqueue *sq, char *buf, int len)
              " bytes_retransmit=%u bytes_invalid=%u"
              " send_seq=%u receive_seq=%u retransmit_seq=%u"
              " srtt=%.3f rttvar=%.3f rto=%.3f"
-             " ready_bytes=%u stalled_bytes=%u"
+             " ready_bytes=%u stalled_bytes=%u bytes_per_write=%.1f"
+             " retransmits=%u short_writes=%u"
              , stats.bytes_write, stats.bytes_read
              , stats.bytes_retransmit, stats.bytes_invalid
              , (int)stats.send_seq, (int)stats.receive_seq
              , (int)stats.retransmit_seq
              , stats.srtt, stats.rttvar, stats.rto
-             , stats.ready_bytes, stats.stalled_bytes);
+             , stats.ready_bytes, stats.stalled_bytes
+             , (stats.write_calls
+                ? (double)stats.bytes_write / stats.write_calls : 0.)
+             , stats.retransmits, stats.short_writes);
+}
+
+// Return the transmit statistics of a command_queue
+void __visible
+serialqueue_get_queue_stats(struct serialqueue *sq, struct command_queue *cq
+                            , struct command_queue_stats *stats)
+{
+    pthread_mutex_lock(&sq->lock);
+    memcpy(stats, &cq->stats, sizeof(*stats));
+    pthread_mutex_unlock(&sq->lock);
+}
+
+// Return the retransmit and ack timing statistics of the serial port
+void __visible
+serialqueue_get_timing_stats(struct serialqueue *sq
+                             , struct serialqueue_stats *stats)
+{
+    pthread_mutex_lock(&sq->lock);
+    stats->retransmits = sq->retransmits;
+    stats->ready_bytes = sq->ready_bytes;
+    stats->stalled_bytes = sq->stalled_bytes;
+    memcpy(&stats->ack_time, &sq->ack_time, sizeof(stats->ack_time));
+    pthread_mutex_unlock(&sq->lock);
 }
 
 // Extract old messages stored in the debug queues
@@ -1107,11 +1928,12 @@ serialqueue_extract_old(struct serialqueue *sq, int sentq
     list_init(&current);
 
     // Atomically replace existing debug list with new zero'd list
-    pthread_mutex_lock(&sq->lock);
+    pthread_mutex_t *lock = sentq ? &sq->lock : &sq->receive_lock;
+    pthread_mutex_lock(lock);
     list_join_tail(rootp, &current);
     list_init(rootp);
     list_join_tail(&replacement, rootp);
-    pthread_mutex_unlock(&sq->lock);
+    pthread_mutex_unlock(lock);
 
     // Walk the debug list
     int pos = 0;
@@ -8,6 +8,7 @@
 
 #define MESSAGE_MIN 5
 #define MESSAGE_MAX 64
+#define MESSAGE_BLOCK_MAX 255
 #define MESSAGE_HEADER_SIZE  2
 #define MESSAGE_TRAILER_SIZE 3
 #define MESSAGE_POS_LEN 0
@@ -19,9 +20,12 @@
 #define MESSAGE_DEST 0x10
 #define MESSAGE_SYNC 0x7E
 
+// Transport backends for serialqueue_alloc()
+#define SQT_TTY 't'
+#define SQT_FD  'f'
+
 struct queue_message {
     int len;
-    uint8_t msg[MESSAGE_MAX];
     union {
         // Filled when on a command queue
         struct {
@@ -33,21 +37,53 @@ struct queue_message {
         };
     };
     uint64_t notify_id;
+    double queue_time; // time queued by serialqueue_send_batch()
+    struct message_chunk *chunk; // arena chunk holding the message (if any)
     struct list_node node;
+    // The message data has room for MESSAGE_MAX bytes (or
+    // MESSAGE_BLOCK_MAX bytes if allocated by block_alloc())
+    uint8_t msg[];
 };
 
 struct queue_message *message_alloc_and_encode(uint32_t *data, int len);
 void message_queue_free(struct list_head *root);
+struct message_arena *message_arena_alloc(void);
+void message_arena_free(struct message_arena *ma);
+struct queue_message *message_arena_encode(struct message_arena *ma
+                                           , uint32_t *data, int len);
 
 struct pull_queue_message {
-    uint8_t msg[MESSAGE_MAX];
+    uint8_t msg[MESSAGE_BLOCK_MAX];
     int len;
     double sent_time, receive_time;
     uint64_t notify_id;
 };
 
+// Histogram of durations - bucket 0 counts durations below
+// SQ_HIST_BASE_TIME and each following bucket covers twice the time
+// range of the one before it (the last bucket is unbounded)
+#define SQ_HIST_SIZE 20
+#define SQ_HIST_BASE_TIME 0.0001
+
+struct sq_histogram {
+    uint32_t count;
+    double sum;
+    uint32_t buckets[SQ_HIST_SIZE];
+};
+
+struct command_queue_stats {
+    uint32_t bytes, stalled_bytes;
+    struct sq_histogram queue_time;
+};
+
+struct serialqueue_stats {
+    uint32_t retransmits, ready_bytes, stalled_bytes;
+    struct sq_histogram ack_time;
+};
+
 struct serialqueue;
-struct serialqueue *serialqueue_alloc(int serial_fd, int write_only);
+struct serialqueue *serialqueue_alloc(int serial_fd, char serial_fd_type
+                                     , int write_only);
 void serialqueue_exit(struct serialqueue *sq);
 void serialqueue_free(struct serialqueue *sq);
 struct command_queue *serialqueue_alloc_commandqueue(void);
@@ -59,9 +95,15 @@ void serialqueue_send(struct serialqueue *sq, struct command_queue *cq
                       , uint64_t req_clock, uint64_t notify_id);
 void serialqueue_pull(struct serialqueue *sq, struct pull_queue_message *pqm);
 void serialqueue_set_baud_adjust(struct serialqueue *sq, double baud_adjust);
+void serialqueue_set_block_max(struct serialqueue *sq, int block_max);
 void serialqueue_set_clock_est(struct serialqueue *sq, double est_freq
                                , double last_clock_time, uint64_t last_clock);
 void serialqueue_get_stats(struct serialqueue *sq, char *buf, int len);
+void serialqueue_get_queue_stats(struct serialqueue *sq
+                                 , struct command_queue *cq
+                                 , struct command_queue_stats *stats);
+void serialqueue_get_timing_stats(struct serialqueue *sq
+                                  , struct serialqueue_stats *stats);
 int serialqueue_extract_old(struct serialqueue *sq, int sentq
                             , struct pull_queue_message *q, int max);
 
@@ -14,6 +14,7 @@
 // This code is written in C (instead of python) for processing
 // efficiency - the repetitive integer math is vastly faster in C.
 
+#include <pthread.h> // pthread_mutex_lock
 #include <stddef.h> // offsetof
 #include <stdint.h> // uint32_t
 #include <stdio.h> // fprintf
@@ -26,6 +27,11 @@
 
 #define CHECK_LINES 1
 #define QUEUE_START_SIZE 1024
+#define MAX_COMPRESS_THREADS 16
+
+struct stepcompress_mirror {
+    uint32_t oid, invert_sdir;
+};
 
 struct stepcompress {
     // Buffer management
@@ -36,11 +42,21 @@ struct stepcompress {
     // Message generation
     uint64_t last_step_clock;
     struct list_head msg_queue;
+    struct message_arena *arena;
     uint32_t queue_step_msgid, set_next_step_dir_msgid, oid;
-    int sdir, invert_sdir;
+    uint32_t queue_step_add2_msgid;
+    int sdir, invert_sdir, compress_mode;
+    // Steppers that are sent a copy of each step command
+    struct stepcompress_mirror *mirrors;
+    int mirror_count;
     // Step+dir+step filter
     uint64_t next_step_clock;
     int next_step_dir;
+    // Background compression
+    struct compress_worker *worker;
+    struct list_node worker_node;
+    int worker_state;
+    int32_t worker_ret;
 };
 
 
@@ -65,15 +81,19 @@ struct points {
 };
 
 // Given a requested step time, return the minimum and maximum
-// acceptable times
+// acceptable times (less the contribution of an 'add2' term)
 static inline struct points
-minmax_point(struct stepcompress *sc, uint32_t *pos)
+minmax_point(struct stepcompress *sc, uint32_t *pos, int32_t add2)
 {
     uint32_t lsc = sc->last_step_clock, point = *pos - lsc;
     uint32_t prevpoint = pos > sc->queue_pos ? *(pos-1) - lsc : 0;
     uint32_t max_error = (point - prevpoint) / 2;
     if (max_error > sc->max_error)
         max_error = sc->max_error;
+    if (add2) {
+        int64_t count = pos - sc->queue_pos + 1;
+        point -= add2 * (int32_t)(count*(count-1)*(count-2)/6);
+    }
     return (struct points){ point - max_error, point };
 }
 
@@ -86,17 +106,41 @@ minmax_point(struct stepcompress *sc, uint32_t *pos)
 struct step_move {
     uint32_t interval;
     uint16_t count;
-    int16_t add;
+    int16_t add, add2;
+};
+
+#define SEARCH_BISECT 16
+#define SEARCH_TRUNCATE 4
+
+struct move_candidates {
+    int num;
+    struct step_move moves[SEARCH_BISECT + SEARCH_TRUNCATE];
 };
 
-// Find a 'step_move' that covers a series of step times
+// Return the largest step count for which the 'add2' term of a
+// sequence does not risk integer overflow
+static int32_t
+add2_max_count(int32_t add2)
+{
+    uint64_t a = add2 < 0 ? -add2 : add2;
+    int32_t count = 65535;
+    while (a * count * count * count > (6ULL << 29))
+        count = count * 7 / 8;
+    return count;
+}
+
+// Find a 'step_move' with the given 'add2' that covers a series of
+// step times (and store the other valid sequences considered in
+// 'cands', if provided)
 static struct step_move
-compress_bisect_add(struct stepcompress *sc)
+compress_bisect_add(struct stepcompress *sc, struct move_candidates *cands
+                    , int32_t add2)
 {
     uint32_t *qlast = sc->queue_next;
-    if (qlast > sc->queue_pos + 65535)
-        qlast = sc->queue_pos + 65535;
-    struct points point = minmax_point(sc, sc->queue_pos);
+    int32_t max_count = add2 ? add2_max_count(add2) : 65535;
+    if (qlast > sc->queue_pos + max_count)
+        qlast = sc->queue_pos + max_count;
+    struct points point = minmax_point(sc, sc->queue_pos, add2);
     int32_t outer_mininterval = point.minp, outer_maxinterval = point.maxp;
     int32_t add = 0, minadd = -0x8000, maxadd = 0x7fff;
     int32_t bestinterval = 0, bestcount = 1, bestadd = 1, bestreach = INT32_MIN;
@@ -112,9 +156,9 @@ compress_bisect_add(struct stepcompress *sc)
             nextcount++;
             if (&sc->queue_pos[nextcount-1] >= qlast) {
                 int32_t count = nextcount - 1;
-                return (struct step_move){ interval, count, add };
+                return (struct step_move){ interval, count, add, add2 };
             }
-            nextpoint = minmax_point(sc, sc->queue_pos + nextcount - 1);
+            nextpoint = minmax_point(sc, sc->queue_pos + nextcount - 1, add2);
             int32_t nextaddfactor = nextcount*(nextcount-1)/2;
             int32_t c = add*nextaddfactor;
             if (nextmininterval*nextcount < nextpoint.minp - c)
@@ -129,6 +173,9 @@ compress_bisect_add(struct stepcompress *sc)
         // Check if this is the best sequence found so far
         int32_t count = nextcount - 1, addfactor = count*(count-1)/2;
         int32_t reach = add*addfactor + interval*count;
+        if (cands && cands->num < SEARCH_BISECT)
+            cands->moves[cands->num++] = (struct step_move){
+                interval, count, add, add2 };
         if (reach > bestreach
             || (reach == bestreach && interval > bestinterval)) {
             bestinterval = interval;
@@ -180,8 +227,145 @@ compress_bisect_add(struct stepcompress *sc)
     }
     if (zerocount + zerocount/16 >= bestcount)
         // Prefer add=0 if it's similar to the best found sequence
-        return (struct step_move){ zerointerval, zerocount, 0 };
-    return (struct step_move){ bestinterval, bestcount, bestadd };
+        return (struct step_move){ zerointerval, zerocount, 0, add2 };
+    return (struct step_move){ bestinterval, bestcount, bestadd, add2 };
+}
+
+// Return the number of clock ticks covered by a 'step_move'
+static inline uint32_t
+step_move_ticks(struct step_move move)
+{
+    int32_t addfactor = move.count*(move.count-1)/2;
+    uint32_t ticks = move.add*addfactor + move.interval*move.count;
+    if (move.add2) {
+        uint64_t count = move.count;
+        ticks += move.add2 * (uint32_t)(count*(count-1)*(count-2)/6);
+    }
+    return ticks;
+}
+
+// The minimum number of steps a third difference of the step times is
+// measured over when estimating 'add2'
+#define ADD2_MIN_SPAN 2
+// The maximum number of 'add2' values tried in each direction
+#define ADD2_MAX_SEARCH 16
+
+// Find a 'step_move' that may also use an 'add2' term.  The 'add2' is
+// estimated from the third difference of the step times over three
+// times the length of the best quadratic sequence, and a sequence
+// using it (or a neighboring value) is used if it is notably longer.
+// Sets 'at_end' if the result may change when more steps are queued.
+static struct step_move
+compress_add2(struct stepcompress *sc, int *at_end)
+{
+    struct step_move best = compress_bisect_add(sc, NULL, 0);
+    uint32_t *qpos = sc->queue_pos, h = best.count;
+    *at_end = qpos + h >= sc->queue_next;
+    if (*at_end || h < ADD2_MIN_SPAN)
+        return best;
+    if (qpos + 3*h > sc->queue_next) {
+        *at_end = 1;
+        return best;
+    }
+    uint32_t lsc = sc->last_step_clock;
+    double p1 = qpos[h-1] - lsc, p2 = qpos[2*h-1] - lsc, p3 = qpos[3*h-1] - lsc;
+    double est = (p3 - 3.*p2 + 3.*p1) / ((double)h * h * h);
+    if (est < -0x7fff || est > 0x7fff)
+        return best;
+    int32_t est_add2 = est < 0. ? (int32_t)(est - .5) : (int32_t)(est + .5);
+    // Search for the longest sequence near the estimated 'add2'
+    struct step_move cubic = best;
+    if (est_add2) {
+        cubic = compress_bisect_add(sc, NULL, est_add2);
+        if (qpos + cubic.count >= sc->queue_next) {
+            *at_end = 1;
+            return best;
+        }
+    }
+    int dir, i;
+    for (dir=-1; dir<=1; dir+=2) {
+        for (i=0; i<ADD2_MAX_SEARCH; i++) {
+            int32_t add2 = cubic.add2 + dir;
+            if (!add2)
+                add2 += dir;
+            if (add2 < -0x7fff || add2 > 0x7fff)
+                break;
+            struct step_move move = compress_bisect_add(sc, NULL, add2);
+            if (qpos + move.count >= sc->queue_next) {
+                *at_end = 1;
+                return best;
+            }
+            if (move.count <= cubic.count)
+                break;
+            cubic = move;
+        }
+    }
+    // Prefer the smaller queue_step command unless 'add2' notably helps
+    if (cubic.count > best.count + best.count/8)
+        return cubic;
+    return best;
+}
+
+// Return the number of steps covered by the sequence that would be
+// chosen after 'move' (or -1 if it depends on steps not yet queued)
+static int
+next_move_count(struct stepcompress *sc, struct step_move move)
+{
+    uint32_t *qpos = sc->queue_pos;
+    uint64_t lsc = sc->last_step_clock;
+    if (qpos + move.count >= sc->queue_next)
+        return -1;
+    sc->queue_pos += move.count;
+    sc->last_step_clock += step_move_ticks(move);
+    struct step_move next = compress_bisect_add(sc, NULL, 0);
+    int count = next.count;
+    if (sc->queue_pos + count >= sc->queue_next)
+        count = -1;
+    sc->queue_pos = qpos;
+    sc->last_step_clock = lsc;
+    return count;
+}
+
+// Find a 'step_move' by also considering the sequence that follows
+// it.  The candidates are the valid sequences considered by
+// compress_bisect_add() and slightly shortened versions of its result.
+// The candidate that covers the most steps together with the sequence
+// chosen after it is used, which often avoids leaving a short sequence
+// behind the greedy choice.  Sets 'at_end' if the result may change
+// when more steps are queued.
+static struct step_move
+compress_search(struct stepcompress *sc, int *at_end)
+{
+    struct move_candidates cands;
+    cands.num = 0;
+    struct step_move greedy = compress_bisect_add(sc, &cands, 0);
+    int greedy_next = next_move_count(sc, greedy);
+    *at_end = greedy_next < 0;
+    if (*at_end)
+        return greedy;
+    int i;
+    for (i=1; i<=SEARCH_TRUNCATE && i<greedy.count; i++) {
+        struct step_move move = greedy;
+        move.count -= i;
+        cands.moves[cands.num++] = move;
+    }
+    struct step_move best = greedy;
+    int best_total = greedy.count + greedy_next;
+    for (i=0; i<cands.num; i++) {
+        struct step_move move = cands.moves[i];
+        if (move.count == greedy.count && move.add == greedy.add)
+            continue;
+        int next = next_move_count(sc, move);
+        if (next < 0) {
+            *at_end = 1;
+            return greedy;
+        }
+        if (move.count + next > best_total) {
+            best = move;
+            best_total = move.count + next;
+        }
+    }
+    return best;
 }
 
 
@@ -197,29 +381,32 @@ check_line(struct stepcompress *sc, struct step_move move)
         return 0;
     if (!move.count || (!move.interval && !move.add && move.count > 1)
         || move.interval >= 0x80000000) {
-        errorf("stepcompress o=%d i=%d c=%d a=%d: Invalid sequence"
-               , sc->oid, move.interval, move.count, move.add);
+        errorf("stepcompress o=%d i=%d c=%d a=%d add2=%d: Invalid sequence"
+               , sc->oid, move.interval, move.count, move.add, move.add2);
         return ERROR_RET;
     }
     uint32_t interval = move.interval, p = 0;
+    int32_t add = move.add;
     uint16_t i;
     for (i=0; i<move.count; i++) {
-        struct points point = minmax_point(sc, sc->queue_pos + i);
+        struct points point = minmax_point(sc, sc->queue_pos + i, 0);
         p += interval;
         if (p < point.minp || p > point.maxp) {
-            errorf("stepcompress o=%d i=%d c=%d a=%d: Point %d: %d not in %d:%d"
-                   , sc->oid, move.interval, move.count, move.add
+            errorf("stepcompress o=%d i=%d c=%d a=%d add2=%d:"
+                   " Point %d: %d not in %d:%d"
+                   , sc->oid, move.interval, move.count, move.add, move.add2
                    , i+1, p, point.minp, point.maxp);
             return ERROR_RET;
         }
         if (interval >= 0x80000000) {
-            errorf("stepcompress o=%d i=%d c=%d a=%d:"
+            errorf("stepcompress o=%d i=%d c=%d a=%d add2=%d:"
                    " Point %d: interval overflow %d"
-                   , sc->oid, move.interval, move.count, move.add
+                   , sc->oid, move.interval, move.count, move.add, move.add2
                    , i+1, interval);
             return ERROR_RET;
         }
-        interval += move.add;
+        interval += add;
+        add += move.add2;
     }
     return 0;
 }
@@ -236,6 +423,7 @@ stepcompress_alloc(uint32_t oid)
     struct stepcompress *sc = malloc(sizeof(*sc));
     memset(sc, 0, sizeof(*sc));
     list_init(&sc->msg_queue);
+    sc->arena = message_arena_alloc();
     sc->oid = oid;
     sc->sdir = -1;
     return sc;
@@ -245,22 +433,51 @@ stepcompress_alloc(uint32_t oid)
 void __visible
 stepcompress_fill(struct stepcompress *sc, uint32_t max_error
                   , uint32_t invert_sdir, uint32_t queue_step_msgid
-                  , uint32_t set_next_step_dir_msgid)
+                  , uint32_t set_next_step_dir_msgid, uint32_t compress_mode)
 {
     sc->max_error = max_error;
+    sc->compress_mode = compress_mode;
     sc->invert_sdir = !!invert_sdir;
     sc->queue_step_msgid = queue_step_msgid;
     sc->set_next_step_dir_msgid = set_next_step_dir_msgid;
 }
 
+// Enable the queue_step_add2 command (if 'queue_step_add2_msgid' is
+// not zero)
+void __visible
+stepcompress_set_add2(struct stepcompress *sc, uint32_t queue_step_add2_msgid)
+{
+    sc->queue_step_add2_msgid = queue_step_add2_msgid;
+}
+
+// Send a copy of all step commands to the stepper with the given oid
+// (used when the mcu can not step several drivers from one timer)
+int __visible
+stepcompress_add_mirror(struct stepcompress *sc, uint32_t oid
+                        , uint32_t invert_sdir)
+{
+    struct stepcompress_mirror *mirrors = realloc(
+        sc->mirrors, (sc->mirror_count + 1) * sizeof(*mirrors));
+    if (!mirrors)
+        return ERROR_RET;
+    mirrors[sc->mirror_count].oid = oid;
+    mirrors[sc->mirror_count].invert_sdir = !!invert_sdir;
+    sc->mirrors = mirrors;
+    sc->mirror_count++;
+    return 0;
+}
+
 // Free memory associated with a 'stepcompress' object
 void __visible
 stepcompress_free(struct stepcompress *sc)
 {
     if (!sc)
         return;
+    stepcompress_wait(sc);
     free(sc->queue);
+    free(sc->mirrors);
     message_queue_free(&sc->msg_queue);
+    message_arena_free(sc->arena);
     free(sc);
 }
 
@@ -294,27 +511,60 @@ stepcompress_set_time(struct stepcompress *sc
     calc_last_step_print_time(sc);
 }
 
-// Convert previously scheduled steps into commands for the mcu
+// Queue a step command (and a copy of it for each mirrored stepper)
+static void
+queue_step_msg(struct stepcompress *sc, uint32_t *msg, int len
+               , uint64_t min_clock, uint64_t req_clock)
+{
+    int i;
+    for (i = -1; i < sc->mirror_count; i++) {
+        if (i >= 0)
+            msg[1] = sc->mirrors[i].oid;
+        struct queue_message *qm = message_arena_encode(sc->arena, msg, len);
+        qm->min_clock = min_clock;
+        qm->req_clock = req_clock;
+        list_add_tail(&qm->node, &sc->msg_queue);
+    }
+}
+
+// Convert previously scheduled steps into commands for the mcu.  In
+// 'lookahead' mode only commands that can not change when further
+// steps are appended to the queue are generated.
 static int
-queue_flush(struct stepcompress *sc, uint64_t move_clock)
+queue_flush(struct stepcompress *sc, uint64_t move_clock, int lookahead)
 {
     if (sc->queue_pos >= sc->queue_next)
         return 0;
     while (sc->last_step_clock < move_clock) {
-        struct step_move move = compress_bisect_add(sc);
+        struct step_move move;
+        int at_end;
+        if (sc->compress_mode == SC_COMPRESS_SEARCH) {
+            move = compress_search(sc, &at_end);
+        } else if (sc->queue_step_add2_msgid) {
+            move = compress_add2(sc, &at_end);
+        } else {
+            move = compress_bisect_add(sc, NULL, 0);
+            at_end = sc->queue_pos + move.count >= sc->queue_next;
+        }
+        if (lookahead && at_end)
+            // The sequence depends on steps not yet in the queue
+            break;
         int ret = check_line(sc, move);
         if (ret)
             return ret;
 
-        uint32_t msg[5] = {
+        uint32_t msg[6] = {
             sc->queue_step_msgid, sc->oid, move.interval, move.count, move.add
+            , move.add2
         };
-        struct queue_message *qm = message_alloc_and_encode(msg, 5);
-        qm->min_clock = qm->req_clock = sc->last_step_clock;
-        int32_t addfactor = move.count*(move.count-1)/2;
-        uint32_t ticks = move.add*addfactor + move.interval*move.count;
-        sc->last_step_clock += ticks;
-        list_add_tail(&qm->node, &sc->msg_queue);
+        int msg_len = 5;
+        if (move.add2) {
+            msg[0] = sc->queue_step_add2_msgid;
+            msg_len = 6;
+        }
+        queue_step_msg(sc, msg, msg_len
+                       , sc->last_step_clock, sc->last_step_clock);
+        sc->last_step_clock += step_move_ticks(move);
 
         if (sc->queue_pos + move.count >= sc->queue_next) {
             sc->queue_pos = sc->queue_next = sc->queue;
@@ -334,10 +584,8 @@ stepcompress_flush_far(struct stepcompress *sc, uint64_t abs_step_clock)
         sc->queue_step_msgid, sc->oid, abs_step_clock - sc->last_step_clock,
         1, 0
     };
-    struct queue_message *qm = message_alloc_and_encode(msg, 5);
-    qm->min_clock = sc->last_step_clock;
-    sc->last_step_clock = qm->req_clock = abs_step_clock;
-    list_add_tail(&qm->node, &sc->msg_queue);
+    queue_step_msg(sc, msg, 5, sc->last_step_clock, abs_step_clock);
+    sc->last_step_clock = abs_step_clock;
     calc_last_step_print_time(sc);
     return 0;
 }
@@ -349,15 +597,22 @@ set_next_step_dir(struct stepcompress *sc, int sdir)
     if (sc->sdir == sdir)
         return 0;
     sc->sdir = sdir;
-    int ret = queue_flush(sc, UINT64_MAX);
+    int ret = queue_flush(sc, UINT64_MAX, 0);
     if (ret)
         return ret;
-    uint32_t msg[3] = {
-        sc->set_next_step_dir_msgid, sc->oid, sdir ^ sc->invert_sdir
-    };
-    struct queue_message *qm = message_alloc_and_encode(msg, 3);
-    qm->req_clock = sc->last_step_clock;
-    list_add_tail(&qm->node, &sc->msg_queue);
+    int i;
+    for (i = -1; i < sc->mirror_count; i++) {
+        uint32_t msg[3] = {
+            sc->set_next_step_dir_msgid, sc->oid, sdir ^ sc->invert_sdir
+        };
+        if (i >= 0) {
+            msg[1] = sc->mirrors[i].oid;
+            msg[2] = sdir ^ sc->mirrors[i].invert_sdir;
+        }
+        struct queue_message *qm = message_arena_encode(sc->arena, msg, 3);
+        qm->req_clock = sc->last_step_clock;
+        list_add_tail(&qm->node, &sc->msg_queue);
+    }
     return 0;
 }
 
@@ -370,7 +625,7 @@ queue_append_far(struct stepcompress *sc)
 {
     uint64_t step_clock = sc->next_step_clock;
     sc->next_step_clock = 0;
-    int ret = queue_flush(sc, step_clock - CLOCK_DIFF_MAX + 1);
+    int ret = queue_flush(sc, step_clock - CLOCK_DIFF_MAX + 1, 0);
     if (ret)
         return ret;
     if (step_clock >= sc->last_step_clock + CLOCK_DIFF_MAX)
@@ -387,7 +642,7 @@ queue_append_extend(struct stepcompress *sc)
         // No point in keeping more than 64K steps in memory
         uint32_t flush = (*(sc->queue_next-65535)
                           - (uint32_t)sc->last_step_clock);
-        int ret = queue_flush(sc, sc->last_step_clock + flush);
+        int ret = queue_flush(sc, sc->last_step_clock + flush, 0);
         if (ret)
             return ret;
     }
@@ -480,12 +735,15 @@ stepcompress_commit(struct stepcompress *sc)
 static int
 stepcompress_flush(struct stepcompress *sc, uint64_t move_clock)
 {
+    int ret = stepcompress_wait(sc);
+    if (ret)
+        return ret;
     if (sc->next_step_clock && move_clock >= sc->next_step_clock) {
-        int ret = queue_append(sc);
+        ret = queue_append(sc);
         if (ret)
             return ret;
     }
-    return queue_flush(sc, move_clock);
+    return queue_flush(sc, move_clock, 0);
 }
 
 // Reset the internal state of the stepcompress object
@@ -509,13 +767,172 @@ stepcompress_queue_msg(struct stepcompress *sc, uint32_t *data, int len)
     if (ret)
         return ret;
 
-    struct queue_message *qm = message_alloc_and_encode(data, len);
+    struct queue_message *qm = message_arena_encode(sc->arena, data, len);
     qm->req_clock = sc->last_step_clock;
     list_add_tail(&qm->node, &sc->msg_queue);
     return 0;
 }
 
 
+/****************************************************************
+ * Background compression
+ ****************************************************************/
+
+// A steppersync may compress the step times of its stepcompress
+// objects in background threads.  After each step generation pass
+// the stepcompress is queued to a worker thread, which generates all
+// queue_step commands that do not depend on steps not yet in the
+// queue.  The stepcompress must not be used by any other thread while
+// it is queued (see stepcompress_wait() ), so the resulting commands
+// are identical to those generated without background compression -
+// steppersync_flush() then typically only needs to merge them.
+
+enum { CW_IDLE, CW_QUEUED, CW_ACTIVE };
+
+struct compress_worker {
+    int num_threads;
+    pthread_t tids[MAX_COMPRESS_THREADS];
+    pthread_mutex_t lock; // protects variables below
+    pthread_cond_t cond, done_cond;
+    int exiting;
+    struct list_head pending;
+};
+
+// Main code for worker threads
+static void *
+compress_thread(void *data)
+{
+    struct compress_worker *cw = data;
+    pthread_mutex_lock(&cw->lock);
+    for (;;) {
+        if (cw->exiting)
+            break;
+        if (list_empty(&cw->pending)) {
+            int ret = pthread_cond_wait(&cw->cond, &cw->lock);
+            if (ret)
+                report_errno("pthread_cond_wait", ret);
+            continue;
+        }
+        struct stepcompress *sc = list_first_entry(
+            &cw->pending, struct stepcompress, worker_node);
+        list_del(&sc->worker_node);
+        sc->worker_state = CW_ACTIVE;
+        pthread_mutex_unlock(&cw->lock);
+        int ret = queue_flush(sc, UINT64_MAX, 1);
+        pthread_mutex_lock(&cw->lock);
+        if (ret && !sc->worker_ret)
+            sc->worker_ret = ret;
+        sc->worker_state = CW_IDLE;
+        pthread_cond_broadcast(&cw->done_cond);
+    }
+    pthread_mutex_unlock(&cw->lock);
+    return NULL;
+}
+
+// Stop the worker threads and free a 'struct compress_worker'
+static void
+compress_worker_free(struct compress_worker *cw)
+{
+    if (!cw)
+        return;
+    pthread_mutex_lock(&cw->lock);
+    cw->exiting = 1;
+    pthread_cond_broadcast(&cw->cond);
+    pthread_mutex_unlock(&cw->lock);
+    int i;
+    for (i=0; i<cw->num_threads; i++) {
+        int ret = pthread_join(cw->tids[i], NULL);
+        if (ret)
+            report_errno("pthread_join", ret);
+    }
+    pthread_cond_destroy(&cw->done_cond);
+    pthread_cond_destroy(&cw->cond);
+    pthread_mutex_destroy(&cw->lock);
+    free(cw);
+}
+
+// Create a new 'struct compress_worker' with the given number of threads
+static struct compress_worker *
+compress_worker_alloc(int num_threads)
+{
+    struct compress_worker *cw = malloc(sizeof(*cw));
+    memset(cw, 0, sizeof(*cw));
+    list_init(&cw->pending);
+    int ret = pthread_mutex_init(&cw->lock, NULL);
+    if (ret)
+        goto fail_lock;
+    ret = pthread_cond_init(&cw->cond, NULL);
+    if (ret)
+        goto fail_cond;
+    ret = pthread_cond_init(&cw->done_cond, NULL);
+    if (ret)
+        goto fail_done_cond;
+    if (num_threads > MAX_COMPRESS_THREADS)
+        num_threads = MAX_COMPRESS_THREADS;
+    int i;
+    for (i=0; i<num_threads; i++) {
+        ret = pthread_create(&cw->tids[i], NULL, compress_thread, cw);
+        if (ret) {
+            // Stop and join the already started threads
+            report_errno("compress worker", ret);
+            compress_worker_free(cw);
+            return NULL;
+        }
+        cw->num_threads++;
+    }
+    return cw;
+
+fail_done_cond:
+    pthread_cond_destroy(&cw->cond);
+fail_cond:
+    pthread_mutex_destroy(&cw->lock);
+fail_lock:
+    report_errno("compress worker", ret);
+    free(cw);
+    return NULL;
+}
+
+// Queue the stepcompress for background compression (if enabled)
+void
+stepcompress_submit(struct stepcompress *sc)
+{
+    struct compress_worker *cw = sc->worker;
+    if (!cw || sc->queue_pos >= sc->queue_next)
+        return;
+    pthread_mutex_lock(&cw->lock);
+    if (sc->worker_state == CW_IDLE) {
+        sc->worker_state = CW_QUEUED;
+        list_add_tail(&sc->worker_node, &cw->pending);
+        pthread_cond_signal(&cw->cond);
+    }
+    pthread_mutex_unlock(&cw->lock);
+}
+
+// Wait for any background compression of the stepcompress to complete
+// (and report any error found during that compression)
+int32_t
+stepcompress_wait(struct stepcompress *sc)
+{
+    struct compress_worker *cw = sc->worker;
+    if (!cw)
+        return 0;
+    pthread_mutex_lock(&cw->lock);
+    if (sc->worker_state == CW_QUEUED) {
+        // Not started yet - the caller will compress the queue anyway
+        list_del(&sc->worker_node);
+        sc->worker_state = CW_IDLE;
+    }
+    while (sc->worker_state != CW_IDLE) {
+        int ret = pthread_cond_wait(&cw->done_cond, &cw->lock);
+        if (ret)
+            report_errno("pthread_cond_wait", ret);
+    }
+    int32_t ret = sc->worker_ret;
+    pthread_mutex_unlock(&cw->lock);
+    return ret;
+}
+
+
 /****************************************************************
  * Step compress synchronization
  ****************************************************************/
@@ -537,6 +954,12 @@ struct steppersync {
     // Storage for list of pending move clocks
     uint64_t *move_clocks;
     int num_move_clocks;
+    // Background compression
+    struct compress_worker *worker;
+    // Batching of queue_step commands into queue_steps commands
+    double mcu_freq;
+    uint8_t queue_step_prefix[5], queue_steps_prefix[5];
+    int queue_step_prefix_len, queue_steps_prefix_len;
 };
 
 // Allocate a new 'steppersync' object
@@ -566,24 +989,91 @@ steppersync_free(struct steppersync *ss)
 {
     if (!ss)
         return;
+    steppersync_set_compress_threads(ss, 0);
     free(ss->sc_list);
     free(ss->move_clocks);
     serialqueue_free_commandqueue(ss->cq);
     free(ss);
 }
 
+// Return the command_queue used to transmit the stepper commands
+struct command_queue * __visible
+steppersync_get_commandqueue(struct steppersync *ss)
+{
+    return ss->cq;
+}
+
 // Set the conversion rate of 'print_time' to mcu clock
 void __visible
 steppersync_set_time(struct steppersync *ss, double time_offset
                      , double mcu_freq)
 {
     int i;
+    ss->mcu_freq = mcu_freq;
     for (i=0; i<ss->sc_num; i++) {
         struct stepcompress *sc = ss->sc_list[i];
+        stepcompress_wait(sc);
         stepcompress_set_time(sc, time_offset, mcu_freq);
     }
 }
 
+// Compress step times in 'num_threads' background threads (or on the
+// calling thread if 'num_threads' is zero)
+int __visible
+steppersync_set_compress_threads(struct steppersync *ss, int num_threads)
+{
+    int i;
+    int32_t ret = 0;
+    if (ss->worker) {
+        for (i=0; i<ss->sc_num; i++) {
+            struct stepcompress *sc = ss->sc_list[i];
+            int32_t sc_ret = stepcompress_wait(sc);
+            if (sc_ret && !ret)
+                ret = sc_ret;
+            sc->worker = NULL;
+        }
+        compress_worker_free(ss->worker);
+        ss->worker = NULL;
+    }
+    if (num_threads <= 0)
+        return ret;
+    ss->worker = compress_worker_alloc(num_threads);
+    if (!ss->worker)
+        return -1;
+    for (i=0; i<ss->sc_num; i++)
+        ss->sc_list[i]->worker = ss->worker;
+    return ret;
+}
+
+// Store the vlq encoding of a message id in 'dest' (returning its length)
+static int
+encode_msgid(uint8_t *dest, uint32_t msgid)
+{
+    struct queue_message *qm = message_alloc_and_encode(&msgid, 1);
+    int len = qm->len;
+    memcpy(dest, qm->msg, len);
+    struct list_head msgs;
+    list_init(&msgs);
+    list_add_tail(&qm->node, &msgs);
+    message_queue_free(&msgs);
+    return len;
+}
+
+// Enable combining consecutive queue_step commands into a single
+// queue_steps command (if 'queue_steps_msgid' is not zero)
+void __visible
+steppersync_set_queue_steps(struct steppersync *ss, uint32_t queue_step_msgid
+                            , uint32_t queue_steps_msgid)
+{
+    ss->queue_step_prefix_len = ss->queue_steps_prefix_len = 0;
+    if (!queue_steps_msgid)
+        return;
+    ss->queue_step_prefix_len = encode_msgid(ss->queue_step_prefix
+                                             , queue_step_msgid);
+    ss->queue_steps_prefix_len = encode_msgid(ss->queue_steps_prefix
+                                              , queue_steps_msgid);
+}
+
 // Implement a binary heap algorithm to track when the next available
 // 'struct move' in the mcu will be available
 static void
@@ -609,6 +1099,75 @@ heap_replace(struct steppersync *ss, uint64_t req_clock)
     }
 }
 
+// A queue_step command is only merged into an earlier queue_steps
+// command if the move queue slots of all of its tuples are expected
+// to be available this long before the first tuple's steps start
+#define QUEUE_STEPS_MIN_SLACK 0.250
+
+// Check if a message is a queue_step command
+static int
+is_queue_step(struct steppersync *ss, struct queue_message *qm)
+{
+    int plen = ss->queue_step_prefix_len;
+    return qm->len > plen && !memcmp(qm->msg, ss->queue_step_prefix, plen);
+}
+
+// Convert a queue_step command into a queue_steps command
+static void
+convert_to_queue_steps(struct steppersync *ss, struct queue_message *qm)
+{
+    int step_len = ss->queue_step_prefix_len;
+    int steps_len = ss->queue_steps_prefix_len;
+    int data_len = qm->len - step_len;
+    memmove(&qm->msg[steps_len + 1], &qm->msg[step_len], data_len);
+    memcpy(qm->msg, ss->queue_steps_prefix, steps_len);
+    qm->msg[steps_len] = data_len;
+    qm->len = steps_len + 1 + data_len;
+}
+
+// Combine runs of consecutive queue_step commands into queue_steps
+// commands to reduce the per command overhead on the serial link
+static void
+batch_queue_steps(struct steppersync *ss, struct list_head *msgs)
+{
+    int step_len = ss->queue_step_prefix_len;
+    int steps_len = ss->queue_steps_prefix_len;
+    uint64_t min_slack = QUEUE_STEPS_MIN_SLACK * ss->mcu_freq;
+    struct list_head merged;
+    list_init(&merged);
+    struct queue_message *qm, *tmp, *batch = NULL;
+    int batch_len = 0, batch_converted = 0;
+    list_for_each_entry_safe(qm, tmp, msgs, node) {
+        if (!is_queue_step(ss, qm)) {
+            batch = NULL;
+            continue;
+        }
+        int data_len = qm->len - step_len;
+        if (!batch || batch_len + data_len > MESSAGE_PAYLOAD_MAX
+            || qm->min_clock + min_slack > batch->req_clock) {
+            // Start a new batch with this command
+            batch = qm;
+            batch_len = data_len + steps_len + 1;
+            batch_converted = 0;
+            continue;
+        }
+        if (!batch_converted) {
+            convert_to_queue_steps(ss, batch);
+            batch_converted = 1;
+        }
+        memcpy(&batch->msg[batch->len], &qm->msg[step_len], data_len);
+        batch->msg[steps_len] += data_len;
+        batch->len += data_len;
+        batch_len = batch->len;
+        // The move queue entries are allocated in order, so the last
+        // command always has the latest 'min_clock'
+        batch->min_clock = qm->min_clock;
+        list_del(&qm->node);
+        list_add_tail(&qm->node, &merged);
+    }
+    message_queue_free(&merged);
+}
+
 // Find and transmit any scheduled steps prior to the given 'move_clock'
 int __visible
 steppersync_flush(struct steppersync *ss, uint64_t move_clock)
@@ -657,6 +1216,8 @@ steppersync_flush(struct steppersync *ss, uint64_t move_clock)
     }
 
     // Transmit commands
+    if (ss->queue_steps_prefix_len)
+        batch_queue_steps(ss, &msgs);
     if (!list_empty(&msgs))
         serialqueue_send_batch(ss->sq, ss->cq, &msgs);
     return 0;
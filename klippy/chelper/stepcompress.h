@@ -3,10 +3,17 @@
 
 #include <stdint.h> // uint32_t
 
+enum { SC_COMPRESS_GREEDY, SC_COMPRESS_SEARCH };
+
 struct stepcompress *stepcompress_alloc(uint32_t oid);
 void stepcompress_fill(struct stepcompress *sc, uint32_t max_error
                        , uint32_t invert_sdir, uint32_t queue_step_msgid
-                       , uint32_t set_next_step_dir_msgid);
+                       , uint32_t set_next_step_dir_msgid
+                       , uint32_t compress_mode);
+void stepcompress_set_add2(struct stepcompress *sc
+                           , uint32_t queue_step_add2_msgid);
+int stepcompress_add_mirror(struct stepcompress *sc, uint32_t oid
+                            , uint32_t invert_sdir);
 void stepcompress_free(struct stepcompress *sc);
 uint32_t stepcompress_get_oid(struct stepcompress *sc);
 int stepcompress_get_step_dir(struct stepcompress *sc);
@@ -15,6 +22,8 @@ int stepcompress_append(struct stepcompress *sc, int sdir
 int stepcompress_commit(struct stepcompress *sc);
 int stepcompress_reset(struct stepcompress *sc, uint64_t last_step_clock);
 int stepcompress_queue_msg(struct stepcompress *sc, uint32_t *data, int len);
+void stepcompress_submit(struct stepcompress *sc);
+int32_t stepcompress_wait(struct stepcompress *sc);
 
 struct serialqueue;
 struct steppersync *steppersync_alloc(
@@ -23,6 +32,11 @@ struct steppersync *steppersync_alloc(
 void steppersync_free(struct steppersync *ss);
 void steppersync_set_time(struct steppersync *ss, double time_offset
                           , double mcu_freq);
+int steppersync_set_compress_threads(struct steppersync *ss, int num_threads);
+void steppersync_set_queue_steps(struct steppersync *ss
+                                 , uint32_t queue_step_msgid
+                                 , uint32_t queue_steps_msgid);
 int steppersync_flush(struct steppersync *ss, uint64_t move_clock);
+struct command_queue *steppersync_get_commandqueue(struct steppersync *ss);
 
 #endif // stepcompress.h
@@ -0,0 +1,193 @@
+// Multi-threaded step generation for a batch of steppers
+//
+// Copyright (C) 2020  Kevin O'Connor <kevin@koconnor.net>
+//
+// This file may be distributed under the terms of the GNU GPLv3 license.
+
+// Each stepper_kinematics object only reads from its trapq and only
+// writes to its own stepcompress queue, so the step generation of
+// different steppers can run in parallel.  A stepper is always fully
+// processed by a single thread, so the generated steps do not depend
+// on the thread scheduling, and steppersync_flush() merges the
+// resulting queue_step messages in clock order as before.
+
+#include <pthread.h> // pthread_mutex_lock
+#include <stdlib.h> // malloc
+#include <string.h> // memset
+#include "compiler.h" // __visible
+#include "itersolve.h" // itersolve_generate_steps
+#include "pyhelper.h" // report_errno
+#include "stepgen.h" // stepgen_batch_alloc
+#include "trapq.h" // trapq_check_sentinels
+
+#define MAX_THREADS 16
+
+struct stepgen_batch {
+    int num_workers;
+    pthread_t tids[MAX_THREADS];
+    pthread_mutex_t lock; // protects variables below
+    pthread_cond_t cond, done_cond;
+    int exiting, active_workers;
+    uint32_t generation;
+    // Current batch
+    struct stepper_kinematics **sks;
+    int count, next_idx, error_idx;
+    int32_t error_ret;
+    double flush_time;
+};
+
+// Claim and generate steps for steppers until none remain in the batch
+static void
+process_steppers(struct stepgen_batch *sgb)
+{
+    while (sgb->next_idx < sgb->count) {
+        int idx = sgb->next_idx++;
+        struct stepper_kinematics *sk = sgb->sks[idx];
+        double flush_time = sgb->flush_time;
+        pthread_mutex_unlock(&sgb->lock);
+        int32_t ret = itersolve_generate_steps(sk, flush_time);
+        pthread_mutex_lock(&sgb->lock);
+        // Report the error of the first failing stepper in the batch
+        if (ret && (sgb->error_idx < 0 || idx < sgb->error_idx)) {
+            sgb->error_idx = idx;
+            sgb->error_ret = ret;
+        }
+    }
+}
+
+// Main code for worker threads
+static void *
+worker_thread(void *data)
+{
+    struct stepgen_batch *sgb = data;
+    pthread_mutex_lock(&sgb->lock);
+    uint32_t generation = sgb->generation;
+    for (;;) {
+        while (!sgb->exiting && sgb->generation == generation) {
+            int ret = pthread_cond_wait(&sgb->cond, &sgb->lock);
+            if (ret)
+                report_errno("pthread_cond_wait", ret);
+        }
+        if (sgb->exiting)
+            break;
+        generation = sgb->generation;
+        sgb->active_workers++;
+        process_steppers(sgb);
+        if (!--sgb->active_workers)
+            pthread_cond_signal(&sgb->done_cond);
+    }
+    pthread_mutex_unlock(&sgb->lock);
+    return NULL;
+}
+
+// Create a new 'struct stepgen_batch' object using up to 'num_threads'
+// threads (including the calling thread) for step generation
+struct stepgen_batch * __visible
+stepgen_batch_alloc(int num_threads)
+{
+    struct stepgen_batch *sgb = malloc(sizeof(*sgb));
+    memset(sgb, 0, sizeof(*sgb));
+    int ret = pthread_mutex_init(&sgb->lock, NULL);
+    if (ret)
+        goto fail_lock;
+    ret = pthread_cond_init(&sgb->cond, NULL);
+    if (ret)
+        goto fail_cond;
+    ret = pthread_cond_init(&sgb->done_cond, NULL);
+    if (ret)
+        goto fail_done_cond;
+    if (num_threads > MAX_THREADS)
+        num_threads = MAX_THREADS;
+    int i;
+    for (i=0; i<num_threads-1; i++) {
+        ret = pthread_create(&sgb->tids[i], NULL, worker_thread, sgb);
+        if (ret) {
+            // Stop and join the already started workers
+            report_errno("pthread_create", ret);
+            stepgen_batch_free(sgb);
+            return NULL;
+        }
+        sgb->num_workers++;
+    }
+    return sgb;
+
+fail_done_cond:
+    pthread_cond_destroy(&sgb->cond);
+fail_cond:
+    pthread_mutex_destroy(&sgb->lock);
+fail_lock:
+    report_errno("init", ret);
+    free(sgb);
+    return NULL;
+}
+
+// Stop the worker threads and free a 'struct stepgen_batch'
+void __visible
+stepgen_batch_free(struct stepgen_batch *sgb)
+{
+    if (!sgb)
+        return;
+    pthread_mutex_lock(&sgb->lock);
+    sgb->exiting = 1;
+    pthread_cond_broadcast(&sgb->cond);
+    pthread_mutex_unlock(&sgb->lock);
+    int i;
+    for (i=0; i<sgb->num_workers; i++) {
+        int ret = pthread_join(sgb->tids[i], NULL);
+        if (ret)
+            report_errno("pthread_join", ret);
+    }
+    pthread_cond_destroy(&sgb->done_cond);
+    pthread_cond_destroy(&sgb->cond);
+    pthread_mutex_destroy(&sgb->lock);
+    free(sgb);
+}
+
+// Generate steps up to 'flush_time' for all the given steppers
+int32_t __visible
+stepgen_batch_generate(struct stepgen_batch *sgb
+                       , struct stepper_kinematics **sks, int count
+                       , double flush_time)
+{
+    // The trapq sentinels and move integral caches are updated on
+    // first access, so do that here before the trapq objects are
+    // shared between threads
+    int i;
+    for (i=0; i<count; i++) {
+        struct trapq *tq = sks[i]->tq;
+        if (!tq)
+            continue;
+        trapq_check_sentinels(tq);
+        if (sks[i]->integral_flags)
+            trapq_update_integrals(tq, sks[i]->integral_flags);
+    }
+    if (!sgb->num_workers || count <= 1) {
+        for (i=0; i<count; i++) {
+            int32_t ret = itersolve_generate_steps(sks[i], flush_time);
+            if (ret)
+                return ret;
+        }
+        return 0;
+    }
+
+    // Hand the batch to the worker threads and process it here as well
+    pthread_mutex_lock(&sgb->lock);
+    sgb->sks = sks;
+    sgb->count = count;
+    sgb->next_idx = 0;
+    sgb->error_idx = -1;
+    sgb->flush_time = flush_time;
+    sgb->generation++;
+    pthread_cond_broadcast(&sgb->cond);
+    process_steppers(sgb);
+    while (sgb->active_workers) {
+        int ret = pthread_cond_wait(&sgb->done_cond, &sgb->lock);
+        if (ret)
+            report_errno("pthread_cond_wait", ret);
+    }
+    int32_t ret = sgb->error_idx >= 0 ? sgb->error_ret : 0;
+    sgb->sks = NULL;
+    sgb->count = 0;
+    pthread_mutex_unlock(&sgb->lock);
+    return ret;
+}
@@ -0,0 +1,14 @@
+#ifndef STEPGEN_H
+#define STEPGEN_H
+
+#include <stdint.h> // int32_t
+
+struct stepper_kinematics;
+
+struct stepgen_batch *stepgen_batch_alloc(int num_threads);
+void stepgen_batch_free(struct stepgen_batch *sgb);
+int32_t stepgen_batch_generate(struct stepgen_batch *sgb
+                               , struct stepper_kinematics **sks, int count
+                               , double flush_time);
+
+#endif // stepgen.h
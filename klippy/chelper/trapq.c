@@ -6,20 +6,12 @@
 
 #include <math.h> // sqrt
 #include <stddef.h> // offsetof
+#include <stdio.h> // snprintf
 #include <stdlib.h> // malloc
 #include <string.h> // memset
 #include "compiler.h" // unlikely
 #include "trapq.h" // move_get_coord
 
-// Allocate a new 'move' object
-struct move *
-move_alloc(void)
-{
-    struct move *m = malloc(sizeof(*m));
-    memset(m, 0, sizeof(*m));
-    return m;
-}
-
 // Fill and add a move to the trapezoid velocity queue
 void __visible
 trapq_append(struct trapq *tq, double print_time, int accel_order
@@ -33,40 +25,39 @@ trapq_append(struct trapq *tq, double print_time, int accel_order
 {
     struct coord start_pos = { .x=start_pos_x, .y=start_pos_y, .z=start_pos_z };
     struct coord axes_r = { .x=axes_r_x, .y=axes_r_y, .z=axes_r_z };
+    struct move m;
+    memset(&m, 0, sizeof(m));
     if (accel_t) {
-        struct move *m = move_alloc();
-        m->print_time = print_time;
-        m->move_t = accel_t;
-        scurve_fill(&m->s, accel_order, accel_t, accel_offset_t, total_accel_t,
+        m.print_time = print_time;
+        m.move_t = accel_t;
+        scurve_fill(&m.s, accel_order, accel_t, accel_offset_t, total_accel_t,
                 start_accel_v, effective_accel);
-        m->start_pos = start_pos;
-        m->axes_r = axes_r;
-        trapq_add_move(tq, m);
+        m.start_pos = start_pos;
+        m.axes_r = axes_r;
+        trapq_add_move(tq, &m);
 
         print_time += accel_t;
-        start_pos = move_get_coord(m, accel_t);
+        start_pos = move_get_coord(&m, accel_t);
     }
     if (cruise_t) {
-        struct move *m = move_alloc();
-        m->print_time = print_time;
-        m->move_t = cruise_t;
-        scurve_fill(&m->s, 2, cruise_t, 0., cruise_t, cruise_v, 0.);
-        m->start_pos = start_pos;
-        m->axes_r = axes_r;
-        trapq_add_move(tq, m);
+        m.print_time = print_time;
+        m.move_t = cruise_t;
+        scurve_fill(&m.s, 2, cruise_t, 0., cruise_t, cruise_v, 0.);
+        m.start_pos = start_pos;
+        m.axes_r = axes_r;
+        trapq_add_move(tq, &m);
 
         print_time += cruise_t;
-        start_pos = move_get_coord(m, cruise_t);
+        start_pos = move_get_coord(&m, cruise_t);
     }
     if (decel_t) {
-        struct move *m = move_alloc();
-        m->print_time = print_time;
-        m->move_t = decel_t;
-        scurve_fill(&m->s, accel_order, decel_t, decel_offset_t, total_decel_t,
+        m.print_time = print_time;
+        m.move_t = decel_t;
+        scurve_fill(&m.s, accel_order, decel_t, decel_offset_t, total_decel_t,
                 cruise_v, -effective_decel);
-        m->start_pos = start_pos;
-        m->axes_r = axes_r;
-        trapq_add_move(tq, m);
+        m.start_pos = start_pos;
+        m.axes_r = axes_r;
+        trapq_add_move(tq, &m);
     }
 }
 
@@ -89,6 +80,7 @@ move_get_coord(struct move *m, double move_time)
 }
 
 #define NEVER_TIME 9999999999999999.9
+#define TRAPQ_INITIAL_SIZE 64
 
 // Allocate a new 'trapq' object
 struct trapq * __visible
@@ -96,11 +88,13 @@ trapq_alloc(void)
 {
     struct trapq *tq = malloc(sizeof(*tq));
     memset(tq, 0, sizeof(*tq));
-    list_init(&tq->moves);
-    struct move *head_sentinel = move_alloc(), *tail_sentinel = move_alloc();
+    tq->moves = malloc(TRAPQ_INITIAL_SIZE * sizeof(*tq->moves));
+    memset(tq->moves, 0, TRAPQ_INITIAL_SIZE * sizeof(*tq->moves));
+    tq->mask = TRAPQ_INITIAL_SIZE - 1;
+    tq->head = 0;
+    tq->tail = 1;
+    struct move *tail_sentinel = trapq_last(tq);
     tail_sentinel->print_time = tail_sentinel->move_t = NEVER_TIME;
-    list_add_head(&head_sentinel->node, &tq->moves);
-    list_add_tail(&tail_sentinel->node, &tq->moves);
     return tq;
 }
 
@@ -108,11 +102,9 @@ trapq_alloc(void)
 void __visible
 trapq_free(struct trapq *tq)
 {
-    while (!list_empty(&tq->moves)) {
-        struct move *m = list_first_entry(&tq->moves, struct move, node);
-        list_del(&m->node);
-        free(m);
-    }
+    free(tq->local_integrals);
+    free(tq->prefix_pa);
+    free(tq->moves);
     free(tq);
 }
 
@@ -120,60 +112,264 @@ trapq_free(struct trapq *tq)
 void
 trapq_check_sentinels(struct trapq *tq)
 {
-    struct move *tail_sentinel = list_last_entry(&tq->moves, struct move, node);
+    struct move *tail_sentinel = trapq_last(tq);
     if (tail_sentinel->print_time)
         // Already up to date
         return;
-    struct move *m = list_prev_entry(tail_sentinel, node);
-    struct move *head_sentinel = list_first_entry(&tq->moves, struct move,node);
-    if (m == head_sentinel) {
+    if (tq->tail - tq->head == 1) {
         // No moves at all on this list
         tail_sentinel->print_time = NEVER_TIME;
         return;
     }
+    struct move *m = trapq_prev(tq, tail_sentinel);
     tail_sentinel->print_time = m->print_time + m->move_t;
     tail_sentinel->start_pos = move_get_coord(m, m->move_t);
 }
 
+// Double the size of the ring buffer
+static void
+trapq_grow(struct trapq *tq)
+{
+    unsigned int size = (tq->mask + 1) * 2, i;
+    struct move *moves = malloc(size * sizeof(*moves));
+    for (i=tq->head; i!=tq->tail+1; i++)
+        moves[i & (size - 1)] = tq->moves[i & tq->mask];
+    free(tq->moves);
+    tq->moves = moves;
+    tq->mask = size - 1;
+}
+
+// Store a move in front of the tail sentinel
+static struct move *
+trapq_insert(struct trapq *tq, const struct move *m)
+{
+    if (tq->tail - tq->head >= tq->mask)
+        trapq_grow(tq);
+    struct move *qm = trapq_last(tq);
+    tq->tail++;
+    struct move *tail_sentinel = trapq_last(tq);
+    *tail_sentinel = *qm;
+    tail_sentinel->print_time = 0.;
+    *qm = *m;
+    if (tq->tail - tq->head - 1 > tq->high_water)
+        tq->high_water = tq->tail - tq->head - 1;
+    return qm;
+}
+
 #define MAX_NULL_MOVE 1.0
 
 // Add a move to the trapezoid velocity queue
-void
-trapq_add_move(struct trapq *tq, struct move *m)
+struct move *
+trapq_add_move(struct trapq *tq, const struct move *m)
 {
-    struct move *tail_sentinel = list_last_entry(&tq->moves, struct move, node);
-    struct move *prev = list_prev_entry(tail_sentinel, node);
+    struct move *prev = trapq_prev(tq, trapq_last(tq));
     if (prev->print_time + prev->move_t < m->print_time) {
         // Add a null move to fill time gap
-        struct move *null_move = move_alloc();
-        null_move->start_pos = m->start_pos;
+        struct move null_move;
+        memset(&null_move, 0, sizeof(null_move));
+        null_move.start_pos = m->start_pos;
         if (!prev->print_time && m->print_time > MAX_NULL_MOVE)
             // Limit the first null move to improve numerical stability
-            null_move->print_time = m->print_time - MAX_NULL_MOVE;
+            null_move.print_time = m->print_time - MAX_NULL_MOVE;
         else
-            null_move->print_time = prev->print_time + prev->move_t;
-        null_move->move_t = m->print_time - null_move->print_time;
-        list_add_before(&null_move->node, &tail_sentinel->node);
+            null_move.print_time = prev->print_time + prev->move_t;
+        null_move.move_t = m->print_time - null_move.print_time;
+        trapq_insert(tq, &null_move);
     }
-    list_add_before(&m->node, &tail_sentinel->node);
-    tail_sentinel->print_time = 0.;
+    return trapq_insert(tq, m);
 }
 
 // Free any moves older than `print_time` from the trapezoid velocity queue
 void __visible
 trapq_free_moves(struct trapq *tq, double print_time)
 {
-    struct move *head_sentinel = list_first_entry(&tq->moves, struct move,node);
-    struct move *tail_sentinel = list_last_entry(&tq->moves, struct move, node);
     for (;;) {
-        struct move *m = list_next_entry(head_sentinel, node);
-        if (m == tail_sentinel) {
-            tail_sentinel->print_time = NEVER_TIME;
+        if (tq->tail - tq->head == 1) {
+            trapq_last(tq)->print_time = NEVER_TIME;
             return;
         }
+        struct move *m = trapq_next(tq, trapq_first(tq));
         if (m->print_time + m->move_t > print_time)
             return;
-        list_del(&m->node);
-        free(m);
+        // The freed move becomes the new head sentinel
+        memset(m, 0, sizeof(*m));
+        tq->head++;
+    }
+}
+
+// Return the first move on the trapq (possibly a sentinel) that ends
+// after 'print_time' - the trapq sentinels must be up to date
+struct move *
+trapq_find_move(struct trapq *tq, double print_time)
+{
+    unsigned int low = 0, high = tq->tail - tq->head;
+    while (low < high) {
+        unsigned int mid = (low + high) / 2;
+        struct move *m = &tq->moves[(tq->head + mid) & tq->mask];
+        if (m->print_time + m->move_t > print_time)
+            high = mid;
+        else
+            low = mid + 1;
+    }
+    return &tq->moves[(tq->head + low) & tq->mask];
+}
+
+// Find the first move that ends after 'print_time' starting at the
+// ring buffer index stored in 'cursor' (and update the cursor to the
+// index of the returned move).  The cursor is only a hint - a binary
+// search is used if its move has since been freed.  The trapq
+// sentinels must be up to date.
+struct move *
+trapq_seek(struct trapq *tq, unsigned int *cursor, double print_time)
+{
+    unsigned int pos = *cursor;
+    if ((int)(pos - tq->head) <= 0 || (int)(tq->tail - pos) < 0) {
+        // Cursor not valid - search the whole queue
+        struct move *m = trapq_find_move(tq, print_time);
+        *cursor = trapq_index(tq, m);
+        return m;
+    }
+    // Walk from the cursor to the requested move
+    struct move *m = &tq->moves[pos & tq->mask];
+    while (pos - tq->head > 1) {
+        struct move *prev = trapq_prev(tq, m);
+        if (prev->print_time + prev->move_t <= print_time)
+            break;
+        m = prev;
+        pos--;
     }
+    while (m->print_time + m->move_t <= print_time) {
+        m = trapq_next(tq, m);
+        pos++;
+    }
+    *cursor = pos;
+    return m;
+}
+
+
+
+/****************************************************************
+ * Move integral cache
+ ****************************************************************/
+
+// The smoothing kinematics (smooth_axis and the extruder pressure
+// advance) average positions over a time window that may span many
+// moves.  To avoid integrating every move in that window on each
+// position calculation, the moments 'integral((t-S)^k * f(t) dt)' of
+// each move are calculated once relative to the move start time S.
+// The smooth_axis kinematics shifts these to the window center (which
+// is never far from any move in the window) and sums them.  The first
+// two extruder moments are also stored as prefix sums (relative to the
+// common reference time T = tq->integrals_time) so that the extruder
+// integral over any range of full moves is the difference of two
+// prefix sums.  The reference time is reset (and the prefix sums
+// recalculated) each time moves are freed from the trapq.  Higher
+// moments are not stored that way as they grow too quickly with
+// the distance from T to be differenced accurately.
+
+// Calculate the moments of a move relative to its start time
+static void
+calc_local_integrals(const struct move *m, int flags
+                     , struct move_integrals *mi)
+{
+    const struct scurve *s = &m->s;
+    double c[7] = { 0., s->c1, s->c2, s->c3, s->c4, s->c5, s->c6 };
+    // Powers of the move duration
+    double mt = m->move_t, mt_pow[13];
+    int i, k, n;
+    mt_pow[0] = 1.;
+    for (i=1; i<ARRAY_SIZE(mt_pow); i++)
+        mt_pow[i] = mt_pow[i-1] * mt;
+    // Moments of 1, s(t), s'(t), and s''(t)
+    double t_k[TQI_MOMENTS], s_k[3][TQI_MOMENTS];
+    for (k=0; k<TQI_MOMENTS; k++) {
+        t_k[k] = mt_pow[k+1] / (k+1);
+        double s0 = 0., s1 = 0., s2 = 0.;
+        for (n=1; n<=6; n++) {
+            s0 += c[n] * mt_pow[n+k+1] / (n+k+1);
+            s1 += n * c[n] * mt_pow[n+k] / (n+k);
+            if (n >= 2)
+                s2 += n * (n-1) * c[n] * mt_pow[n+k-1] / (n+k-1);
+        }
+        s_k[0][k] = s0;
+        s_k[1][k] = s1;
+        s_k[2][k] = s2;
+    }
+    for (i=0; i<2 && flags & TQI_AXES; i++) {
+        double start_pos = m->start_pos.axis[i], axis_r = m->axes_r.axis[i];
+        for (k=0; k<TQI_MOMENTS; k++) {
+            mi->axes[i][0][k] = start_pos * t_k[k] + axis_r * s_k[0][k];
+            mi->axes[i][1][k] = axis_r * s_k[1][k];
+            mi->axes[i][2][k] = axis_r * s_k[2][k];
+        }
+    }
+    // The extruder trapq stores the pressure advance in axes_r.y
+    double pressure_advance = m->axes_r.y;
+    for (k=0; k<2 && flags & TQI_PA; k++)
+        mi->pa[k] = (m->start_pos.x * t_k[k] + m->axes_r.x
+                     * (s_k[0][k] + pressure_advance * s_k[1][k]));
+}
+
+// Make sure the move integral cache is up to date for all moves on
+// the trapq.  This must not be called concurrently with itself or
+// with any user of the cache.
+void
+trapq_update_integrals(struct trapq *tq, int flags)
+{
+    if (tq->integrals_head == tq->head && tq->integrals_tail == tq->tail
+        && (flags & tq->integral_flags) == flags)
+        // Already up to date
+        return;
+    if ((flags & tq->integral_flags) != flags) {
+        // Enable the cache
+        tq->integral_flags |= flags;
+        tq->integrals_size = 0;
+    }
+    if (!tq->integral_flags)
+        return;
+    unsigned int size = tq->mask + 1;
+    if (tq->integrals_size != size) {
+        // Allocate (or reallocate after trapq_grow) the cache
+        free(tq->local_integrals);
+        free(tq->prefix_pa);
+        tq->local_integrals = malloc(size * sizeof(*tq->local_integrals));
+        tq->prefix_pa = malloc(size * sizeof(*tq->prefix_pa));
+        tq->integrals_size = size;
+        tq->integrals_local_tail = tq->head + 1;
+        tq->integrals_head = tq->head - 1;
+    }
+    if ((int)(tq->integrals_local_tail - tq->head) <= 0)
+        tq->integrals_local_tail = tq->head + 1;
+    unsigned int pos = tq->integrals_tail;
+    if (tq->integrals_head != tq->head) {
+        // Reset the reference time to the first move on the trapq
+        tq->integrals_head = tq->head;
+        pos = tq->head + 1;
+        tq->integrals_time = tq->moves[pos & tq->mask].print_time;
+        memset(tq->prefix_pa[pos & tq->mask], 0, sizeof(*tq->prefix_pa));
+    }
+    for (; pos != tq->tail; pos++) {
+        unsigned int idx = pos & tq->mask, next_idx = (pos + 1) & tq->mask;
+        struct move *m = &tq->moves[idx];
+        struct move_integrals *local = &tq->local_integrals[idx];
+        if ((int)(pos - tq->integrals_local_tail) >= 0) {
+            calc_local_integrals(m, tq->integral_flags, local);
+            tq->integrals_local_tail = pos + 1;
+        }
+        if (!(tq->integral_flags & TQI_PA))
+            continue;
+        double *prefix = tq->prefix_pa[next_idx], *prev = tq->prefix_pa[idx];
+        double offset = m->print_time - tq->integrals_time;
+        prefix[0] = prev[0] + local->pa[0];
+        prefix[1] = prev[1] + local->pa[1] + offset * local->pa[0];
+    }
+    tq->integrals_tail = pos;
+}
+
+// Report the move storage statistics of a 'trapq' object
+void __visible
+trapq_get_stats(struct trapq *tq, char *buf, int len)
+{
+    snprintf(buf, len, "moves=%u moves_max=%u move_pool=%u"
+             , tq->tail - tq->head - 1, tq->high_water, tq->mask + 1);
 }
@@ -1,7 +1,6 @@
 #ifndef TRAPQ_H
 #define TRAPQ_H
 
-#include "list.h" // list_node
 #include "scurve.h"  // scurve
 
 struct coord {
@@ -17,15 +16,35 @@ struct move {
     double print_time, move_t;
     struct coord start_pos, axes_r;
     struct scurve s;
+};
+
+// Moments of the x/y position, velocity and acceleration, and of the
+// pressure advanced extruder position, of a move on a trapq relative to
+// its start time (see trapq_update_integrals() )
+enum { TQI_AXES = 1<<0, TQI_PA = 1<<1 };
+#define TQI_MOMENTS 5
 
-    struct list_node node;
+struct move_integrals {
+    double axes[2][3][TQI_MOMENTS];
+    double pa[2];
 };
 
+// The moves are stored in a ring buffer (whose size is a power of two)
+// between a head sentinel at index 'head' and a tail sentinel at index
+// 'tail'.  The indexes are free running and are masked on access.
 struct trapq {
-    struct list_head moves;
+    struct move *moves;
+    unsigned int mask, head, tail;
+    unsigned int high_water;
+    // Move integral cache
+    int integral_flags;
+    unsigned int integrals_size, integrals_head, integrals_tail;
+    unsigned int integrals_local_tail;
+    double integrals_time;
+    struct move_integrals *local_integrals;
+    double (*prefix_pa)[2];
 };
 
-struct move *move_alloc(void);
 void trapq_append(struct trapq *tq, double print_time, int accel_order
                   , double accel_t, double accel_offset_t, double total_accel_t
                   , double cruise_t
@@ -39,7 +58,62 @@ struct coord move_get_coord(struct move *m, double move_time);
 struct trapq *trapq_alloc(void);
 void trapq_free(struct trapq *tq);
 void trapq_check_sentinels(struct trapq *tq);
-void trapq_add_move(struct trapq *tq, struct move *m);
+struct move *trapq_add_move(struct trapq *tq, const struct move *m);
 void trapq_free_moves(struct trapq *tq, double print_time);
+void trapq_get_stats(struct trapq *tq, char *buf, int len);
+struct move *trapq_find_move(struct trapq *tq, double print_time);
+struct move *trapq_seek(struct trapq *tq, unsigned int *cursor
+                        , double print_time);
+void trapq_update_integrals(struct trapq *tq, int flags);
+
+// Return the head sentinel of the trapq
+static inline struct move *
+trapq_first(struct trapq *tq)
+{
+    return &tq->moves[tq->head & tq->mask];
+}
+
+// Return the tail sentinel of the trapq
+static inline struct move *
+trapq_last(struct trapq *tq)
+{
+    return &tq->moves[tq->tail & tq->mask];
+}
+
+// Return the (free running) ring buffer index of a move on the trapq
+static inline unsigned int
+trapq_index(struct trapq *tq, const struct move *m)
+{
+    return tq->head + ((m - trapq_first(tq)) & tq->mask);
+}
+
+// Return the move following 'm' on the trapq
+static inline struct move *
+trapq_next(struct trapq *tq, const struct move *m)
+{
+    return &tq->moves[(m - tq->moves + 1) & tq->mask];
+}
+
+// Return the move preceding 'm' on the trapq
+static inline struct move *
+trapq_prev(struct trapq *tq, const struct move *m)
+{
+    return &tq->moves[(m - tq->moves - 1) & tq->mask];
+}
+
+// Return the moments of move 'm' (relative to its start time)
+static inline const struct move_integrals *
+trapq_move_integrals(struct trapq *tq, const struct move *m)
+{
+    return &tq->local_integrals[m - tq->moves];
+}
+
+// Return the sum of the extruder moments of all moves preceding 'm'
+// (relative to tq->integrals_time)
+static inline const double *
+trapq_prefix_pa(struct trapq *tq, const struct move *m)
+{
+    return tq->prefix_pa[m - tq->moves];
+}
 
 #endif // trapq.h
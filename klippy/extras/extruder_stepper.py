@@ -19,7 +19,7 @@ class ExtruderStepper:
         extruder = self.printer.lookup_object(self.extruder_name)
         self.stepper.set_trapq(extruder.get_trapq())
         toolhead = self.printer.lookup_object('toolhead')
-        toolhead.register_step_generator(self.stepper.generate_steps)
+        toolhead.register_stepper(self.stepper)
 
 def load_config_prefix(config):
     return ExtruderStepper(config)
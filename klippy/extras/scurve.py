@@ -21,11 +21,14 @@ class AccelCombiningMoveQueue:
         self.junction_flush = old_queue.junction_flush
         self.last_step_gen_time = self.toolhead.reactor.monotonic()
         ffi_main, ffi_lib = chelper.get_ffi()
-        self.cqueue = ffi_main.gc(ffi_lib.moveq_alloc(), ffi_lib.free)
+        self.cqueue = ffi_main.gc(ffi_lib.moveq_alloc(), ffi_lib.moveq_free)
         self.moveq_add = ffi_lib.moveq_add
         self.moveq_plan = ffi_lib.moveq_plan
         self.moveq_getmove = ffi_lib.moveq_getmove
         self.moveq_reset = ffi_lib.moveq_reset
+        self.moveq_get_stats = ffi_lib.moveq_get_stats
+        self.moveq_stats_buf = ffi_main.new('char[128]')
+        self.ffi_main = ffi_main
         self.cmove_accel_decel = ffi_main.gc(
                 ffi_lib.move_accel_decel_alloc(), ffi_lib.free)
     def reset(self):
@@ -35,6 +38,10 @@ class AccelCombiningMoveQueue:
         self.last_step_gen_time = self.toolhead.reactor.monotonic()
     def set_flush_time(self, flush_time):
         self.junction_flush = flush_time
+    def get_stats(self):
+        self.moveq_get_stats(self.cqueue, self.moveq_stats_buf,
+                             len(self.moveq_stats_buf))
+        return self.ffi_main.string(self.moveq_stats_buf)
     def get_last(self):
         if self.queue:
             return self.queue[-1]
@@ -109,6 +116,7 @@ class SCurve:
         self.printer = config.get_printer()
         self.printer.register_event_handler("klippy:connect", self.connect)
         self.toolhead = None
+        self.move_queue = None
         self.min_jerk_limit_time = config.getfloat(
                 'min_jerk_limit_time', 0., minval=0.)
         self.max_jerk = config.getfloat('max_jerk', None, above=0.)
@@ -129,8 +137,13 @@ class SCurve:
         # Inject a new move queue
         new_move_queue = AccelCombiningMoveQueue(self, self.toolhead)
         self.toolhead.replace_move_queue(new_move_queue)
+        self.move_queue = new_move_queue
         # Inject new get_max_axis_halt computation
         default_get_max_axis_halt = self.toolhead.get_max_axis_halt
+    def stats(self, eventtime):
+        if self.move_queue is None:
+            return False, ""
+        return False, self.move_queue.get_stats()
     cmd_SET_SCURVE_help = "Set S-Curve parameters"
     def cmd_SET_SCURVE(self, params):
         gcode = self.printer.lookup_object('gcode')
@@ -21,7 +21,7 @@ class WinchKinematics:
             self.anchors.append(a)
             s.setup_itersolve('winch_stepper_alloc', *a)
             s.set_trapq(toolhead.get_trapq())
-            toolhead.register_step_generator(s.generate_steps)
+            toolhead.register_stepper(s)
         # Setup stepper max halt velocity
         max_velocity, max_accel = toolhead.get_max_velocity()
         max_halt_velocity = toolhead.get_max_axis_halt()
@@ -45,7 +45,7 @@ class MCU_endstop:
             self._mcu.add_config_cmd(
                 "endstop_set_stepper oid=%d pos=%d stepper_oid=%d" % (
                     self._oid, i, s.get_oid()), is_init=True)
-        cmd_queue = self._mcu.alloc_command_queue()
+        cmd_queue = self._mcu.alloc_command_queue("endstop_" + self._pin)
         self._home_cmd = self._mcu.lookup_command(
             "endstop_home oid=%c clock=%u sample_ticks=%u sample_count=%c"
             " rest_ticks=%u pin_value=%c", cq=cmd_queue)
@@ -149,7 +149,7 @@ class MCU_digital_out:
             " max_duration=%d" % (
                 self._oid, self._pin, self._start_value, self._shutdown_value,
                 self._mcu.seconds_to_clock(self._max_duration)))
-        cmd_queue = self._mcu.alloc_command_queue()
+        cmd_queue = self._mcu.alloc_command_queue("digital_out_" + self._pin)
         self._set_cmd = self._mcu.lookup_command(
             "schedule_digital_out oid=%c clock=%u value=%c", cq=cmd_queue)
     def set_digital(self, print_time, value):
@@ -192,7 +192,7 @@ class MCU_pwm:
         self._shutdown_value = max(0., min(1., shutdown_value))
         self._is_static = is_static
     def _build_config(self):
-        cmd_queue = self._mcu.alloc_command_queue()
+        cmd_queue = self._mcu.alloc_command_queue("pwm_" + self._pin)
         cycle_ticks = self._mcu.seconds_to_clock(self._cycle_time)
         if self._hardware_pwm:
             self._pwm_max = self._mcu.get_constant_float("PWM_MAX")
@@ -393,7 +393,8 @@ class MCU:
             serial_rts = False
         baud = 0
         if not (self._serialport.startswith("/dev/rpmsg_")
-                or self._serialport.startswith("/tmp/klipper_host_")):
+                or self._serialport.startswith("/tmp/klipper_host_")
+                or self._serialport.startswith("unix:")):
             baud = config.getint('baud', 250000, minval=2400)
         self._serial = serialhdl.SerialReader(
             self._reactor, self._serialport, baud, serial_rts)
@@ -421,6 +422,9 @@ class MCU:
         ffi_main, self._ffi_lib = chelper.get_ffi()
         self._max_stepper_error = config.getfloat(
             'max_stepper_error', 0.000025, minval=0.)
+        self._step_compress_threads = config.getint(
+            'step_compress_threads', 0, minval=0, maxval=16)
+        self._serial_stats_log = config.get('serial_stats_log', None)
         self._stepqueues = []
         self._steppersync = None
         # Stats
@@ -574,6 +578,20 @@ class MCU:
             move_count)
         self._ffi_lib.steppersync_set_time(
             self._steppersync, 0., self._mcu_freq)
+        ret = self._ffi_lib.steppersync_set_compress_threads(
+            self._steppersync, self._step_compress_threads)
+        if ret:
+            raise error("Unable to start step compression threads")
+        if self._stepqueues and self.try_lookup_command(
+                "queue_steps data=%*s") is not None:
+            self._ffi_lib.steppersync_set_queue_steps(
+                self._steppersync,
+                self.lookup_command_id(
+                    "queue_step oid=%c interval=%u count=%hu add=%hi"),
+                self.lookup_command_id("queue_steps data=%*s"))
+        self._serial.register_command_queue(
+            self._ffi_lib.steppersync_get_commandqueue(self._steppersync),
+            "stepper")
         # Log config information
         move_msg = "Configured MCU '%s' (%d moves)" % (self._name, move_count)
         logging.info(move_msg)
@@ -592,6 +610,8 @@ class MCU:
                 self._clocksync.connect(self._serial)
             except serialhdl.error as e:
                 raise error(str(e))
+            if self._serial_stats_log is not None:
+                self._serial.open_stats_log(self._serial_stats_log)
         logging.info(self._log_info())
         ppins = self._printer.lookup_object('pins')
         pin_resolver = ppins.get_pin_resolver(self._name)
@@ -645,8 +665,8 @@ class MCU:
         return self._name
     def register_response(self, cb, msg, oid=None):
         self._serial.register_response(cb, msg, oid)
-    def alloc_command_queue(self):
-        return self._serial.alloc_command_queue()
+    def alloc_command_queue(self, name=None):
+        return self._serial.alloc_command_queue(name)
     def lookup_command(self, msgformat, cq=None):
         return CommandWrapper(self._serial, msgformat, cq)
     def lookup_query_command(self, msgformat, respformat, oid=None,
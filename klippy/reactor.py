@@ -3,7 +3,7 @@
 # Copyright (C) 2016-2019  Kevin O'Connor <kevin@koconnor.net>
 #
 # This file may be distributed under the terms of the GNU GPLv3 license.
-import os, select, math, time, Queue
+import os, select, math, time, heapq, Queue
 import greenlet
 import chelper, util
 
@@ -14,6 +14,8 @@ class ReactorTimer:
     def __init__(self, callback, waketime):
         self.callback = callback
         self.waketime = waketime
+        self.heap_entry = None
+        self.check_pass = 0
 
 class ReactorCompletion:
     class sentinel: pass
@@ -97,9 +99,10 @@ class SelectReactor:
         # Main code
         self._process = False
         self.monotonic = chelper.get_ffi()[1].get_monotonic
-        # Timers
-        self._timers = []
-        self._next_timer = self.NEVER
+        # Timers (a heap of [waketime, seq, timer] entries - an entry is
+        # invalidated by clearing its timer instead of removing it)
+        self._timer_heap = []
+        self._timer_seq = self._timer_stale = self._check_pass = 0
         # Callbacks
         self._pipe_fds = None
         self._async_queue = Queue.Queue()
@@ -109,39 +112,67 @@ class SelectReactor:
         self._g_dispatch = None
         self._greenlets = []
     # Timers
-    def update_timer(self, timer_handler, waketime):
+    def _set_timer(self, timer_handler, waketime):
+        entry = timer_handler.heap_entry
+        if entry is not None:
+            entry[2] = None
+            timer_handler.heap_entry = None
+            self._timer_stale += 1
         timer_handler.waketime = waketime
-        self._next_timer = min(self._next_timer, waketime)
+        if waketime >= self.NEVER:
+            return
+        heap = self._timer_heap
+        self._timer_seq += 1
+        entry = [waketime, self._timer_seq, timer_handler]
+        timer_handler.heap_entry = entry
+        heapq.heappush(heap, entry)
+        if self._timer_stale > 32 and self._timer_stale * 2 > len(heap):
+            # Discard invalidated entries (modify in place as
+            # _check_timers() may be using the heap)
+            heap[:] = [e for e in heap if e[2] is not None]
+            heapq.heapify(heap)
+            self._timer_stale = 0
+    def update_timer(self, timer_handler, waketime):
+        if (waketime == timer_handler.waketime
+            and (timer_handler.heap_entry is not None
+                 or waketime >= self.NEVER)):
+            return
+        self._set_timer(timer_handler, waketime)
     def register_timer(self, callback, waketime=NEVER):
-        timer_handler = ReactorTimer(callback, waketime)
-        timers = list(self._timers)
-        timers.append(timer_handler)
-        self._timers = timers
-        self._next_timer = min(self._next_timer, waketime)
+        timer_handler = ReactorTimer(callback, self.NEVER)
+        self._set_timer(timer_handler, waketime)
         return timer_handler
     def unregister_timer(self, timer_handler):
-        timer_handler.waketime = self.NEVER
-        timers = list(self._timers)
-        timers.pop(timers.index(timer_handler))
-        self._timers = timers
+        self._set_timer(timer_handler, self.NEVER)
+    def _next_timer(self):
+        heap = self._timer_heap
+        while heap and heap[0][2] is None:
+            heapq.heappop(heap)
+            self._timer_stale -= 1
+        if not heap:
+            return self.NEVER
+        return heap[0][0]
     def _check_timers(self, eventtime):
-        if eventtime < self._next_timer:
-            return min(1., max(.001, self._next_timer - eventtime))
-        self._next_timer = self.NEVER
+        # Each timer is invoked at most once per pass
+        self._check_pass += 1
+        check_pass = self._check_pass
         g_dispatch = self._g_dispatch
-        for t in self._timers:
-            waketime = t.waketime
-            if eventtime >= waketime:
-                t.waketime = self.NEVER
-                t.waketime = waketime = t.callback(eventtime)
-                if g_dispatch is not self._g_dispatch:
-                    self._next_timer = min(self._next_timer, waketime)
-                    self._end_greenlet(g_dispatch)
-                    return 0.
-            self._next_timer = min(self._next_timer, waketime)
-        if eventtime >= self._next_timer:
-            return 0.
-        return min(1., max(.001, self._next_timer - self.monotonic()))
+        heap = self._timer_heap
+        while 1:
+            next_timer = self._next_timer()
+            if eventtime < next_timer:
+                return min(1., max(.001, next_timer - self.monotonic()))
+            t = heap[0][2]
+            if t.check_pass == check_pass:
+                return 0.
+            heapq.heappop(heap)
+            t.heap_entry = None
+            t.check_pass = check_pass
+            t.waketime = self.NEVER
+            self._set_timer(t, t.callback(eventtime))
+            if g_dispatch is not self._g_dispatch:
+                self._end_greenlet(g_dispatch)
+                return 0.
     # Callbacks and Completions
     def completion(self):
         return ReactorCompletion(self)
@@ -204,7 +235,6 @@ class SelectReactor:
             g_next = ReactorGreenlet(run=self._dispatch_loop)
         g_next.parent = g.parent
         g.timer = self.register_timer(g.switch, waketime)
-        self._next_timer = self.NOW
         # Switch to _dispatch_loop (via _end_greenlet or direct)
         eventtime = g_next.switch()
         # This greenlet activated from g.timer.callback (via _check_timers)
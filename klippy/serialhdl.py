@@ -3,7 +3,7 @@
 # Copyright (C) 2016-2020  Kevin O'Connor <kevin@koconnor.net>
 #
 # This file may be distributed under the terms of the GNU GPLv3 license.
-import logging, threading
+import logging, threading, os, socket, struct
 import serial
 
 import msgproto, chelper, util
@@ -24,8 +24,13 @@ class SerialReader:
         # C interface
         self.ffi_main, self.ffi_lib = chelper.get_ffi()
         self.serialqueue = None
-        self.default_cmd_queue = self.alloc_command_queue()
+        self.cmd_queues = []
+        self.default_cmd_queue = self.alloc_command_queue("default")
         self.stats_buf = self.ffi_main.new('char[4096]')
+        self.timing_stats = self.ffi_main.new('struct serialqueue_stats *')
+        self.last_hist = {}
+        self.stats_log = None
+        self.stats_log_queues = {}
         # Threading
         self.lock = threading.Lock()
         self.background_thread = None
@@ -90,6 +95,10 @@ class SerialReader:
                     self.ser.port = self.serialport
                     self.ser.rts = self.rts
                     self.ser.open()
+                elif self.serialport.startswith('unix:'):
+                    self.ser = socket.socket(socket.AF_UNIX,
+                                             socket.SOCK_STREAM)
+                    self.ser.connect(self.serialport[5:])
                 else:
                     self.ser = open(self.serialport, 'rb+')
             except (OSError, IOError, serial.SerialException) as e:
@@ -98,8 +107,9 @@ class SerialReader:
                 continue
             if self.baud:
                 stk500v2_leave(self.ser, self.reactor)
-            self.serialqueue = self.ffi_lib.serialqueue_alloc(
-                self.ser.fileno(), 0)
+            fd = self.ser.fileno()
+            fd_type = 't' if os.isatty(fd) else 'f'
+            self.serialqueue = self.ffi_lib.serialqueue_alloc(fd, fd_type, 0)
             self.background_thread = threading.Thread(target=self._bg_thread)
             self.background_thread.start()
             # Obtain and load the data dictionary from the firmware
@@ -123,10 +133,14 @@ class SerialReader:
         if receive_window is not None:
             self.ffi_lib.serialqueue_set_receive_window(
                 self.serialqueue, receive_window)
+        block_max = msgparser.get_constant_int('MESSAGE_RECEIVE_MAX', None)
+        if block_max is not None:
+            self.ffi_lib.serialqueue_set_block_max(self.serialqueue, block_max)
     def connect_file(self, debugoutput, dictionary, pace=False):
         self.ser = debugoutput
         self.msgparser.process_identify(dictionary, decompress=False)
-        self.serialqueue = self.ffi_lib.serialqueue_alloc(self.ser.fileno(), 1)
+        self.serialqueue = self.ffi_lib.serialqueue_alloc(
+            self.ser.fileno(), 'f', 1)
     def set_clock_est(self, freq, last_time, last_clock):
         self.ffi_lib.serialqueue_set_clock_est(
             self.serialqueue, freq, last_time, last_clock)
@@ -143,12 +157,72 @@ class SerialReader:
         for pn in self.pending_notifications.values():
             pn.complete(None)
         self.pending_notifications.clear()
+    def _hist_interval(self, key, hist):
+        # Return the average duration of histogram entries since last call
+        count, total = hist.count, hist.sum
+        last_count, last_total = self.last_hist.get(key, (0, 0.))
+        self.last_hist[key] = (count, total)
+        if count < last_count:
+            # Statistics were reset
+            last_count, last_total = 0, 0.
+        if count == last_count:
+            return None
+        return (total - last_total) / (count - last_count)
     def stats(self, eventtime):
         if self.serialqueue is None:
             return ""
         self.ffi_lib.serialqueue_get_stats(
             self.serialqueue, self.stats_buf, len(self.stats_buf))
-        return self.ffi_main.string(self.stats_buf)
+        msg = [self.ffi_main.string(self.stats_buf)]
+        ts = self.timing_stats
+        self.ffi_lib.serialqueue_get_timing_stats(self.serialqueue, ts)
+        avg = self._hist_interval("#ack", ts.ack_time)
+        if avg is not None:
+            msg.append("ack_time=%.6f" % (avg,))
+        qstats = []
+        for name, cmd_queue in self.cmd_queues:
+            qs = self.ffi_main.new('struct command_queue_stats *')
+            self.ffi_lib.serialqueue_get_queue_stats(
+                self.serialqueue, cmd_queue, qs)
+            qstats.append(qs)
+            avg = self._hist_interval(name, qs.queue_time)
+            if avg is not None:
+                msg.append("%s_queue_time=%.6f" % (name, avg))
+        if self.stats_log is not None:
+            self._write_stats_log(eventtime, ts, qstats)
+        return ' '.join(msg)
+    # Binary statistics log
+    def open_stats_log(self, filename):
+        self.stats_log = open(filename, 'ab')
+    def _pack_hist(self, hist):
+        buckets = [hist.buckets[i] for i in range(len(hist.buckets))]
+        return struct.pack('<Id%dI' % (len(buckets),),
+                           hist.count, hist.sum, *buckets)
+    def _write_stats_log(self, eventtime, ts, qstats):
+        # Records are a one character type code followed by:
+        #  'N': queue_id (u8), name length (u8), name
+        #  'S': eventtime (double), retransmits, ready_bytes,
+        #       stalled_bytes (u32), ack_time histogram
+        #  'Q': queue_id (u8), bytes, stalled_bytes (u32),
+        #       queue_time histogram
+        # A histogram is a count (u32), a sum (double), and the bucket
+        # counts (u32).  All values are little-endian and cumulative.
+        out = [struct.pack('<cdIII', 'S', eventtime, ts.retransmits,
+                           ts.ready_bytes, ts.stalled_bytes),
+               self._pack_hist(ts.ack_time)]
+        logged = self.stats_log_queues
+        for qid, ((name, cmd_queue), qs) in enumerate(
+                zip(self.cmd_queues, qstats)):
+            cur = (qs.queue_time.count, qs.stalled_bytes)
+            if qid in logged and logged[qid] == cur:
+                continue
+            if qid not in logged:
+                out.append(struct.pack('<cBB', 'N', qid, len(name)) + name)
+            logged[qid] = cur
+            out.append(struct.pack('<cBII', 'Q', qid, qs.bytes,
+                                   qs.stalled_bytes))
+            out.append(self._pack_hist(qs.queue_time))
+        self.stats_log.write(''.join(out))
     def get_reactor(self):
         return self.reactor
     def get_msgparser(self):
@@ -184,9 +258,17 @@ class SerialReader:
         cmd = self.msgparser.create_command(msg)
         src = SerialRetryCommand(self, response)
         return src.get_response(cmd, self.default_cmd_queue)
-    def alloc_command_queue(self):
-        return self.ffi_main.gc(self.ffi_lib.serialqueue_alloc_commandqueue(),
-                                self.ffi_lib.serialqueue_free_commandqueue)
+    def alloc_command_queue(self, name=None):
+        cmd_queue = self.ffi_main.gc(
+            self.ffi_lib.serialqueue_alloc_commandqueue(),
+            self.ffi_lib.serialqueue_free_commandqueue)
+        self.register_command_queue(cmd_queue, name)
+        return cmd_queue
+    def register_command_queue(self, cmd_queue, name=None):
+        # Track a command queue so that its statistics are reported
+        if name is None:
+            name = "queue%d" % (len(self.cmd_queues),)
+        self.cmd_queues.append((name, cmd_queue))
     # Dumping debug lists
     def dump_debug(self):
         out = []
@@ -17,10 +17,13 @@ class error(Exception):
 # Interface to low-level mcu and chelper code
 class MCU_stepper:
     def __init__(self, name, step_pin_params, dir_pin_params, step_dist,
-                 units_in_radians=False):
+                 units_in_radians=False, compress_mode=0,
+                 hardware_timer=False):
         self._name = name
         self._step_dist = step_dist
         self._units_in_radians = units_in_radians
+        self._compress_mode = compress_mode
+        self._hardware_timer = hardware_timer
         self._mcu = step_pin_params['chip']
         self._oid = oid = self._mcu.create_oid()
         self._mcu.register_config_callback(self._build_config)
@@ -33,6 +36,8 @@ class MCU_stepper:
         self._invert_dir = dir_pin_params['invert']
         self._mcu_position_offset = self._tag_position = 0.
         self._min_stop_interval = 0.
+        self._group_pins = []
+        self._mirror_oids = []
         self._reset_cmd_id = self._get_position_cmd = None
         self._active_callbacks = []
         ffi_main, self._ffi_lib = chelper.get_ffi()
@@ -76,6 +81,40 @@ class MCU_stepper:
                 self._oid, self._step_pin, self._dir_pin,
                 self._mcu.seconds_to_clock(min_stop_interval),
                 self._invert_step))
+        has_group = self._mcu.try_lookup_command(
+            "config_stepper_group oid=%c step_pin=%c dir_pin=%c"
+            " invert_step=%c invert_dir=%c") is not None
+        for step_pin, dir_pin, invert_step, invert_dir in self._group_pins:
+            if has_group:
+                self._mcu.add_config_cmd(
+                    "config_stepper_group oid=%d step_pin=%s dir_pin=%s"
+                    " invert_step=%d invert_dir=%d" % (
+                        self._oid, step_pin, dir_pin, invert_step,
+                        invert_dir))
+                continue
+            # The mcu does not support stepper groups - configure the
+            # pins as a separate stepper and send it a copy of each
+            # step command.
+            oid = self._mcu.create_oid()
+            self._mcu.add_config_cmd(
+                "config_stepper oid=%d step_pin=%s dir_pin=%s"
+                " min_stop_interval=%d invert_step=%d" % (
+                    oid, step_pin, dir_pin,
+                    self._mcu.seconds_to_clock(min_stop_interval),
+                    invert_step))
+            self._mcu.add_config_cmd(
+                "reset_step_clock oid=%d clock=0" % (oid,), is_init=True)
+            self._ffi_lib.stepcompress_add_mirror(
+                self._stepqueue, oid, invert_dir ^ self._invert_dir)
+            self._mirror_oids.append(oid)
+        if self._hardware_timer:
+            if self._mcu.try_lookup_command(
+                    "config_stepper_hwtimer oid=%c") is None:
+                raise self._mcu.get_printer().config_error(
+                    "Stepper '%s' hardware_timer not supported by mcu '%s'"
+                    % (self._name, self._mcu.get_name()))
+            self._mcu.add_config_cmd(
+                "config_stepper_hwtimer oid=%d" % (self._oid,))
         self._mcu.add_config_cmd(
             "reset_step_clock oid=%d clock=0" % (self._oid,), is_init=True)
         step_cmd_id = self._mcu.lookup_command_id(
@@ -89,7 +128,22 @@ class MCU_stepper:
             "stepper_position oid=%c pos=%i", oid=self._oid)
         self._ffi_lib.stepcompress_fill(
             self._stepqueue, self._mcu.seconds_to_clock(max_error),
-            self._invert_dir, step_cmd_id, dir_cmd_id)
+            self._invert_dir, step_cmd_id, dir_cmd_id, self._compress_mode)
+        if self._mcu.get_constants().get('STEPPER_ADD2'):
+            add2_cmd_id = self._mcu.lookup_command_id(
+                "queue_step_add2 oid=%c interval=%u count=%hu add=%hi"
+                " add2=%hi")
+            self._ffi_lib.stepcompress_set_add2(self._stepqueue, add2_cmd_id)
+    def add_group_pins(self, step_pin_params, dir_pin_params):
+        # Step another stepper driver along with this stepper
+        if (step_pin_params['chip'] is not self._mcu
+            or dir_pin_params['chip'] is not self._mcu):
+            raise self._mcu.get_printer().config_error(
+                "Grouped stepper must be on same mcu as its primary stepper")
+        # The mcu inverts the dir pin relative to this stepper's dir pin
+        invert_dir = dir_pin_params['invert'] ^ self._invert_dir
+        self._group_pins.append((step_pin_params['pin'], dir_pin_params['pin'],
+                                 step_pin_params['invert'], invert_dir))
     def get_oid(self):
         return self._oid
     def get_step_dist(self):
@@ -131,11 +185,12 @@ class MCU_stepper:
         ret = self._ffi_lib.stepcompress_reset(self._stepqueue, 0)
         if ret:
             raise error("Internal error in stepcompress")
-        data = (self._reset_cmd_id, self._oid, 0)
-        ret = self._ffi_lib.stepcompress_queue_msg(
-            self._stepqueue, data, len(data))
-        if ret:
-            raise error("Internal error in stepcompress")
+        for oid in [self._oid] + self._mirror_oids:
+            data = (self._reset_cmd_id, oid, 0)
+            ret = self._ffi_lib.stepcompress_queue_msg(
+                self._stepqueue, data, len(data))
+            if ret:
+                raise error("Internal error in stepcompress")
         if not did_trigger or self._mcu.is_fileoutput():
             return
         params = self._get_position_cmd.send([self._oid])
@@ -153,7 +208,7 @@ class MCU_stepper:
         return old_tq
     def add_active_callback(self, cb):
         self._active_callbacks.append(cb)
-    def generate_steps(self, flush_time):
+    def prepare_step_generation(self, flush_time):
         # Check for activity if necessary
         if self._active_callbacks:
             ret = self._itersolve_check_active(self._stepper_kinematics,
@@ -163,15 +218,33 @@ class MCU_stepper:
                 self._active_callbacks = []
                 for cb in cbs:
                     cb(ret)
+        return self._stepper_kinematics
+    def generate_steps(self, flush_time):
+        sk = self.prepare_step_generation(flush_time)
         # Generate steps
-        ret = self._itersolve_generate_steps(self._stepper_kinematics,
-                                             flush_time)
+        ret = self._itersolve_generate_steps(sk, flush_time)
         if ret:
             raise error("Internal error in stepcompress")
     def is_active_axis(self, axis):
         return self._ffi_lib.itersolve_is_active_axis(
             self._stepper_kinematics, axis)
 
+# A stepper driver that the mcu steps along with another stepper (it
+# shares that stepper's timer and queue_step commands)
+class MCU_grouped_stepper:
+    def __init__(self, name, primary, step_pin_params, dir_pin_params):
+        self._name = name
+        self._primary = primary
+        primary.add_group_pins(step_pin_params, dir_pin_params)
+    def get_mcu(self):
+        return self._primary.get_mcu()
+    def get_name(self, short=False):
+        if short and self._name.startswith('stepper_'):
+            return self._name[8:]
+        return self._name
+    def add_active_callback(self, cb):
+        self._primary.add_active_callback(cb)
+
 # Helper code to build a stepper object from a config section
 def PrinterStepper(config, units_in_radians=False):
     printer = config.get_printer()
@@ -183,8 +256,12 @@ def PrinterStepper(config, units_in_radians=False):
     dir_pin = config.get('dir_pin')
     dir_pin_params = ppins.lookup_pin(dir_pin, can_invert=True)
     step_dist = config.getfloat('step_distance', above=0.)
+    compress_modes = {'greedy': 0, 'search': 1}
+    compress_mode = config.getchoice('step_compression', compress_modes,
+                                     'greedy')
+    hardware_timer = config.getboolean('hardware_timer', False)
     mcu_stepper = MCU_stepper(name, step_pin_params, dir_pin_params, step_dist,
-                              units_in_radians)
+                              units_in_radians, compress_mode, hardware_timer)
     # Support for stepper enable pin handling
     stepper_enable = printer.try_load_module(config, 'stepper_enable')
     stepper_enable.register_stepper(mcu_stepper, config.get('enable_pin', None))
@@ -277,6 +354,9 @@ class PrinterRail:
     def get_endstops(self):
         return list(self.endstops)
     def add_extra_stepper(self, config):
+        if self.steppers and config.getboolean('share_step_timing', False):
+            self.add_grouped_stepper(config)
+            return
         stepper = PrinterStepper(config, self.stepper_units_in_radians)
         self.steppers.append(stepper)
         if self.endstops and config.get('endstop_pin', None) is None:
@@ -291,6 +371,30 @@ class PrinterRail:
         self.endstops.append((mcu_endstop, name))
         query_endstops = printer.try_load_module(config, 'query_endstops')
         query_endstops.register_endstop(mcu_endstop, name)
+    def add_grouped_stepper(self, config):
+        primary = self.steppers[0]
+        if config.get('endstop_pin', None) is not None:
+            raise config.error(
+                "Stepper '%s' with share_step_timing may not define an"
+                " endstop_pin" % (config.get_name(),))
+        step_dist = config.getfloat('step_distance', above=0.)
+        if step_dist != primary.get_step_dist():
+            raise config.error(
+                "Stepper '%s' with share_step_timing must have the same"
+                " step_distance as '%s'" % (
+                    config.get_name(), primary.get_name()))
+        printer = config.get_printer()
+        ppins = printer.lookup_object('pins')
+        step_pin_params = ppins.lookup_pin(config.get('step_pin'),
+                                           can_invert=True)
+        dir_pin_params = ppins.lookup_pin(config.get('dir_pin'),
+                                          can_invert=True)
+        stepper = MCU_grouped_stepper(config.get_name(), primary,
+                                      step_pin_params, dir_pin_params)
+        # Support for stepper enable pin handling
+        stepper_enable = printer.try_load_module(config, 'stepper_enable')
+        stepper_enable.register_stepper(stepper,
+                                        config.get('enable_pin', None))
     def setup_itersolve(self, alloc_func, *params):
         for stepper in self.steppers:
             stepper.setup_itersolve(alloc_func, *params)
@@ -4,7 +4,7 @@
 #
 # This file may be distributed under the terms of the GNU GPLv3 license.
 import math, logging, importlib
-import mcu, homing, chelper, kinematics.extruder
+import mcu, homing, stepper, chelper, kinematics.extruder
 
 # Common suffixes: _d is distance (in mm), _v is velocity (in
 #   mm/second), _v2 is velocity squared (mm^2/s^2), _t is time (in
@@ -255,7 +255,18 @@ class ToolHead:
         self.trapq = ffi_main.gc(ffi_lib.trapq_alloc(), ffi_lib.trapq_free)
         self.trapq_append = ffi_lib.trapq_append
         self.trapq_free_moves = ffi_lib.trapq_free_moves
+        self.trapq_get_stats = ffi_lib.trapq_get_stats
+        self.trapq_stats_buf = ffi_main.new('char[128]')
+        self.ffi_main = ffi_main
         self.step_generators = []
+        # Setup multi-threaded step generation
+        self.steppers = []
+        stepgen_threads = config.getint('step_generation_threads', 1,
+                                        minval=1, maxval=16)
+        self.stepgen_batch = ffi_main.gc(
+            ffi_lib.stepgen_batch_alloc(stepgen_threads),
+            ffi_lib.stepgen_batch_free)
+        self.stepgen_batch_generate = ffi_lib.stepgen_batch_generate
         # Create kinematics class
         self.extruder = kinematics.extruder.DummyExtruder()
         kin_name = config.get('kinematics')
@@ -282,6 +293,14 @@ class ToolHead:
         self.printer.try_load_module(config, "manual_probe")
         self.printer.try_load_module(config, "tuning_tower")
     # Print time tracking
+    def _generate_steps(self, flush_time):
+        for sg in self.step_generators:
+            sg(flush_time)
+        sks = [s.prepare_step_generation(flush_time) for s in self.steppers]
+        ret = self.stepgen_batch_generate(self.stepgen_batch, sks, len(sks),
+                                          flush_time)
+        if ret:
+            raise stepper.error("Internal error in stepcompress")
     def _update_move_time(self, next_print_time):
         batch_time = MOVE_BATCH_TIME
         kin_flush_delay = self.kin_flush_delay
@@ -289,8 +308,7 @@ class ToolHead:
         while 1:
             self.print_time = min(self.print_time + batch_time, next_print_time)
             sg_flush_time = max(lkft, self.print_time - kin_flush_delay)
-            for sg in self.step_generators:
-                sg(sg_flush_time)
+            self._generate_steps(sg_flush_time)
             free_time = max(lkft, sg_flush_time - kin_flush_delay)
             self.trapq_free_moves(self.trapq, free_time)
             self.extruder.update_move_time(free_time)
@@ -488,8 +506,12 @@ class ToolHead:
         is_active = buffer_time > -60. or not self.special_queuing_state
         if self.special_queuing_state == "Drip":
             buffer_time = 0.
-        return is_active, "print_time=%.3f buffer_time=%.3f print_stall=%d" % (
+        stats = "print_time=%.3f buffer_time=%.3f print_stall=%d" % (
             self.print_time, max(buffer_time, 0.), self.print_stall)
+        self.trapq_get_stats(self.trapq, self.trapq_stats_buf,
+                             len(self.trapq_stats_buf))
+        return is_active, "%s %s" % (
+            stats, self.ffi_main.string(self.trapq_stats_buf))
     def check_busy(self, eventtime):
         est_print_time = self.mcu.estimated_print_time(eventtime)
         lookahead_empty = self.move_queue.is_empty()
@@ -525,6 +547,8 @@ class ToolHead:
         self.move_queue = new_move_queue
     def register_step_generator(self, handler):
         self.step_generators.append(handler)
+    def register_stepper(self, stepper):
+        self.steppers.append(stepper)
     def note_step_generation_scan_time(self, delay, old_delay=0.):
         self.flush_step_generation()
         cur_delay = self.kin_flush_delay
@@ -14,8 +14,8 @@ TASK_MAX=0.0025
 
 APPLY_PREFIX = [
     'mcu_awake', 'mcu_task_avg', 'mcu_task_stddev', 'bytes_write',
-    'bytes_read', 'bytes_retransmit', 'freq', 'adj',
-    'target', 'temp', 'pwm'
+    'bytes_read', 'bytes_retransmit', 'bytes_per_write', 'freq', 'adj',
+    'retransmits', 'short_writes', 'ack_time', 'target', 'temp', 'pwm'
 ]
 
 def parse_log(logname, mcu):
@@ -0,0 +1,89 @@
+#!/usr/bin/env python2
+# Script to decode a serial_stats_log file written by klippy
+#
+# Copyright (C) 2020  Kevin O'Connor <kevin@koconnor.net>
+#
+# This file may be distributed under the terms of the GNU GPLv3 license.
+import optparse, struct
+
+HIST_SIZE = 20
+HIST_BASE_TIME = 0.0001
+
+def read_struct(f, fmt):
+    data = f.read(struct.calcsize(fmt))
+    if len(data) < struct.calcsize(fmt):
+        raise EOFError()
+    return struct.unpack(fmt, data)
+
+def read_hist(f):
+    data = read_struct(f, '<Id%dI' % (HIST_SIZE,))
+    return data[0], data[1], list(data[2:])
+
+# Return the average and an upper bound on the given percentile of
+# the entries added to a histogram between two samples
+def hist_interval(last, cur, percentile=.99):
+    if last is None or cur[0] < last[0]:
+        last = (0, 0., [0] * HIST_SIZE)
+    count = cur[0] - last[0]
+    if not count:
+        return None
+    buckets = [c - l for c, l in zip(cur[2], last[2])]
+    need = count * percentile
+    total = 0
+    for i, b in enumerate(buckets):
+        total += b
+        if total >= need:
+            break
+    return (cur[1] - last[1]) / count, HIST_BASE_TIME * 2**i
+
+def format_hist(name, last, cur):
+    res = hist_interval(last, cur)
+    if res is None:
+        return []
+    return ["%s=%.6f" % (name, res[0]), "%s_p99=%.4f" % (name, res[1])]
+
+def main():
+    usage = "%prog [options] <serial stats log>"
+    opts = optparse.OptionParser(usage)
+    options, args = opts.parse_args()
+    if len(args) != 1:
+        opts.error("Incorrect number of arguments")
+    f = open(args[0], 'rb')
+    names = {}
+    last_serial = last_ack = None
+    last_queues = {}
+    out = None
+    while 1:
+        try:
+            rtype = read_struct(f, '<c')[0]
+            if rtype == 'N':
+                qid, namelen = read_struct(f, '<BB')
+                names[qid] = f.read(namelen)
+            elif rtype == 'S':
+                if out is not None:
+                    print ' '.join(out)
+                serial = read_struct(f, '<dIII')
+                ack = read_hist(f)
+                retransmits = serial[1] - (last_serial or serial)[1]
+                out = ["%.3f:" % (serial[0],),
+                       "retransmits=%d" % (max(0, retransmits),),
+                       "ready_bytes=%d stalled_bytes=%d" % serial[2:]]
+                out += format_hist("ack_time", last_ack, ack)
+                last_serial, last_ack = serial, ack
+            elif rtype == 'Q':
+                qid, qbytes, stalled_bytes = read_struct(f, '<BII')
+                qhist = read_hist(f)
+                name = names.get(qid, "queue%d" % (qid,))
+                last = last_queues.get(qid)
+                last_queues[qid] = qhist
+                out.append("%s_stalled_bytes=%d" % (name, stalled_bytes))
+                out += format_hist(name + "_queue_time", last, qhist)
+            else:
+                raise ValueError("Invalid record type %r" % (rtype,))
+        except EOFError:
+            break
+    if out is not None:
+        print ' '.join(out)
+
+if __name__ == '__main__':
+    main()
@@ -4,7 +4,39 @@
 # Copyright (C) 2016  Kevin O'Connor <kevin@koconnor.net>
 #
 # This file may be distributed under the terms of the GNU GPLv3 license.
-import optparse
+import optparse, ast
+
+# Decode a vlq encoded integer (as sent by the host) at 'pos' of 'data'
+def parse_int(data, pos):
+    c = ord(data[pos])
+    pos += 1
+    v = c & 0x7f
+    if (c & 0x60) == 0x60:
+        v |= -0x20
+    while c & 0x80:
+        c = ord(data[pos])
+        pos += 1
+        v = (v<<7) | (c & 0x7f)
+    return v, pos
+
+# Extract the oid/interval/count/add tuples from a queue_steps command
+def parse_queue_steps(line):
+    data = ast.literal_eval(line[line.index('data=')+5:].strip())
+    pos = 0
+    out = []
+    while pos < len(data):
+        oid, pos = parse_int(data, pos)
+        interval, pos = parse_int(data, pos)
+        count, pos = parse_int(data, pos)
+        add, pos = parse_int(data, pos)
+        out.append({'oid': str(oid & 0xff), 'count': str(count & 0xffff)})
+    return out
+
+# Account for one queued set of steps
+def note_queue_step(steppers, args):
+    so = steppers[args['oid']]
+    so[2] += 1
+    so[{'0': 3, '1': 4}[so[1]]] += int(args['count'])
 
 def main():
     usage = "%prog [options] <comms file>"
@@ -20,18 +52,21 @@ def main():
         parts = line.split()
         if not parts:
             continue
+        if parts[0] == 'queue_steps':
+            # The data blob may contain spaces - decode it separately
+            for args in parse_queue_steps(line):
+                note_queue_step(steppers, args)
+            continue
         args = dict([p.split('=', 1) for p in parts[1:]])
         if parts[0] == 'config_stepper':
             # steppers[oid] = [dir_cmds, dir, queue_cmds, pos steps, neg steps]
-            steppers[args['oid']] = [0, 0, 0, 0, 0]
+            steppers[args['oid']] = [0, '0', 0, 0, 0]
         elif parts[0] == 'set_next_step_dir':
             so = steppers[args['oid']]
             so[0] += 1
             so[1] = args['dir']
-        elif parts[0] == 'queue_step':
-            so = steppers[args['oid']]
-            so[2] += 1
-            so[{'0': 3, '1': 4}[so[1]]] += int(args['count'])
+        elif parts[0] in ('queue_step', 'queue_step_add2'):
+            note_queue_step(steppers, args)
     for oid, so in sorted([(int(i[0]), i[1]) for i in steppers.items()]):
         print "oid:%3d dir_cmds:%6d queue_cmds:%7d (%8d -%8d = %8d)" % (
             oid, so[0], so[2], so[4], so[3], so[4]-so[3])
@@ -6,6 +6,7 @@
 
 #include <stdarg.h> // va_start
 #include <string.h> // memcpy
+#include "autoconf.h" // CONFIG_EXTENDED_FRAMING
 #include "board/io.h" // readb
 #include "board/irq.h" // irq_poll
 #include "board/misc.h" // crc16_ccitt
@@ -53,6 +54,13 @@ parse_int(uint8_t **pp)
     return v;
 }
 
+// Parse a vlq encoded integer from the data of a buffer parameter
+uint32_t
+command_parse_int(uint8_t **pp)
+{
+    return parse_int(pp);
+}
+
 // Parse an incoming command into 'args'
 uint8_t *
 command_parsef(uint8_t *p, uint8_t *maxend
@@ -223,6 +231,10 @@ const struct command_encoder encode_acknak PROGMEM = {
     .max_size = MESSAGE_MIN,
 };
 
+#if CONFIG_EXTENDED_FRAMING
+DECL_CONSTANT("MESSAGE_RECEIVE_MAX", MESSAGE_RECEIVE_MAX);
+#endif
+
 enum { CF_NEED_SYNC=1<<0, CF_NEED_VALID=1<<1 };
 
 // Find the next complete message block
@@ -235,7 +247,8 @@ command_find_block(uint8_t *buf, uint_fast8_t buf_len, uint_fast8_t *pop_count)
     if (buf_len < MESSAGE_MIN)
         goto need_more_data;
     uint_fast8_t msglen = buf[MESSAGE_POS_LEN];
-    if (msglen < MESSAGE_MIN || msglen > MESSAGE_MAX)
+    // Check that MESSAGE_MIN <= msglen <= MESSAGE_RECEIVE_MAX
+    if ((uint8_t)(msglen - MESSAGE_MIN) > MESSAGE_RECEIVE_MAX - MESSAGE_MIN)
         goto error;
     uint_fast8_t msgseq = buf[MESSAGE_POS_SEQ];
     if ((msgseq & ~MESSAGE_SEQ_MASK) != MESSAGE_DEST)
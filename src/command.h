@@ -55,6 +55,8 @@
 #define MESSAGE_SEQ_MASK 0x0f
 #define MESSAGE_DEST 0x10
 #define MESSAGE_SYNC 0x7E
+// Maximum size of a message block received from the host
+#define MESSAGE_RECEIVE_MAX (CONFIG_EXTENDED_FRAMING ? 255 : MESSAGE_MAX)
 
 struct command_encoder {
     uint8_t msg_id, max_size, num_params;
@@ -71,6 +73,7 @@ enum {
 };
 
 // command.c
+uint32_t command_parse_int(uint8_t **pp);
 uint8_t *command_parsef(uint8_t *p, uint8_t *maxend
                         , const struct command_parser *cp, uint32_t *args);
 uint_fast8_t command_encodef(uint8_t *buf, const struct command_encoder *ce
@@ -76,7 +76,8 @@ console_sendf(const struct command_encoder *ce, va_list args)
  ****************************************************************/
 
 static struct task_wake usb_bulk_out_wake;
-static uint8_t receive_buf[128], receive_pos;
+static uint8_t receive_buf[MESSAGE_RECEIVE_MAX + USB_CDC_EP_BULK_OUT_SIZE];
+static uint_fast16_t receive_pos;
 
 void
 usb_notify_bulk_out(void)
@@ -90,7 +91,8 @@ usb_bulk_out_task(void)
     if (!sched_check_wake(&usb_bulk_out_wake))
         return;
     // Read data
-    uint_fast8_t rpos = receive_pos, pop_count;
+    uint_fast16_t rpos = receive_pos;
+    uint_fast8_t pop_count;
     if (rpos + USB_CDC_EP_BULK_OUT_SIZE <= sizeof(receive_buf)) {
         int_fast8_t ret = usb_read_bulk_out(
             &receive_buf[rpos], USB_CDC_EP_BULK_OUT_SIZE);
@@ -102,10 +104,11 @@ usb_bulk_out_task(void)
         usb_notify_bulk_out();
     }
     // Process a message block
-    int_fast8_t ret = command_find_and_dispatch(receive_buf, rpos, &pop_count);
+    uint_fast8_t len = rpos > MESSAGE_RECEIVE_MAX ? MESSAGE_RECEIVE_MAX : rpos;
+    int_fast8_t ret = command_find_and_dispatch(receive_buf, len, &pop_count);
     if (ret) {
         // Move buffer
-        uint_fast8_t needcopy = rpos - pop_count;
+        uint_fast16_t needcopy = rpos - pop_count;
         if (needcopy) {
             memmove(receive_buf, &receive_buf[pop_count], needcopy);
             usb_notify_bulk_out();
@@ -14,6 +14,7 @@
 #include <sys/timerfd.h> // timerfd_create
 #include <time.h> // struct timespec
 #include <unistd.h> // ttyname
+#include "autoconf.h" // CONFIG_EXTENDED_FRAMING
 #include "board/irq.h" // irq_poll
 #include "board/misc.h" // console_sendf
 #include "command.h" // command_find_block
@@ -155,7 +156,8 @@ console_task(void)
 
     // Find and dispatch message blocks in the input
     int len = receive_pos + ret;
-    uint_fast8_t pop_count, msglen = len > MESSAGE_MAX ? MESSAGE_MAX : len;
+    uint_fast8_t pop_count, msglen = (len > MESSAGE_RECEIVE_MAX
+                                      ? MESSAGE_RECEIVE_MAX : len);
     ret = command_find_and_dispatch(receive_buf, msglen, &pop_count);
     if (ret) {
         len -= pop_count;
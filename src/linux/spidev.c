@@ -10,6 +10,7 @@
 #include <string.h> // memset
 #include <sys/ioctl.h> // ioctl
 #include <unistd.h> // write
+#include "autoconf.h" // CONFIG_WANT_STEP_BENCHMARK
 #include "command.h" // DECL_COMMAND
 #include "gpio.h" // spi_setup
 #include "internal.h" // report_errno
@@ -112,10 +113,18 @@ spi_transfer(struct spi_config config, uint8_t receive_data
 struct gpio_out
 gpio_out_setup(uint8_t pin, uint8_t val)
 {
-    shutdown("gpio_out_setup not supported");
+    // The step rate benchmark drives steppers on dummy pins
+    if (!CONFIG_WANT_STEP_BENCHMARK)
+        shutdown("gpio_out_setup not supported");
+    return (struct gpio_out){ .pin = pin };
 }
 
 void
 gpio_out_write(struct gpio_out g, uint8_t val)
 {
 }
+
+void
+gpio_out_toggle_noirq(struct gpio_out g)
+{
+}
@@ -20,8 +20,7 @@
  * Timers
  ****************************************************************/
 
-static struct timer periodic_timer, *timer_list = &periodic_timer;
-static struct timer sentinel_timer, deleted_timer;
+static struct timer periodic_timer, sentinel_timer, deleted_timer;
 
 // The periodic_timer simplifies the timer code by ensuring there is
 // always a timer on the timer list and that there is always a timer
@@ -58,6 +57,21 @@ static struct timer sentinel_timer = {
     .waketime = 0x80000000,
 };
 
+// The deleted timer is used when deleting an active timer.
+static uint_fast8_t
+deleted_event(struct timer *t)
+{
+    return SF_DONE;
+}
+
+static struct timer deleted_timer = {
+    .func = deleted_event,
+};
+
+#if !CONFIG_SCHED_HEAP
+
+static struct timer *timer_list = &periodic_timer;
+
 // Find position for a timer in timer_list and insert it
 static void __always_inline
 insert_timer(struct timer *t, uint32_t waketime)
@@ -101,17 +115,6 @@ sched_add_timer(struct timer *add)
     irq_restore(flag);
 }
 
-// The deleted timer is used when deleting an active timer.
-static uint_fast8_t
-deleted_event(struct timer *t)
-{
-    return SF_DONE;
-}
-
-static struct timer deleted_timer = {
-    .func = deleted_event,
-};
-
 // Remove a timer that may be live.
 void
 sched_del_timer(struct timer *del)
@@ -176,6 +179,153 @@ sched_timer_reset(void)
     timer_kick();
 }
 
+#else // CONFIG_SCHED_HEAP
+
+// With CONFIG_SCHED_HEAP the scheduled timers are stored in a binary
+// min-heap ordered by waketime instead of in a sorted list, so that
+// adding and rescheduling a timer is O(log n) instead of O(n).  As
+// with timer_list, the timer at the root of the heap is always the
+// next to be dispatched, and deleted_timer is placed at the root
+// when the next timer is deleted or a new timer is added before it.
+// The periodic_timer ensures all waketimes in the heap are within
+// 0x80000000 of each other so that timer_is_before() can order them.
+static struct timer *timer_heap[CONFIG_SCHED_HEAP_SIZE] = { &periodic_timer };
+static uint_fast16_t timer_heap_count = 1;
+
+// Move a timer towards the root of the heap until its parent is not
+// after it and store it there
+static void
+heap_sift_up(struct timer *t, uint_fast16_t pos)
+{
+    uint32_t waketime = t->waketime;
+    while (pos) {
+        uint_fast16_t parent = (pos - 1) / 2;
+        struct timer *p = timer_heap[parent];
+        if (!timer_is_before(waketime, p->waketime))
+            break;
+        timer_heap[pos] = p;
+        pos = parent;
+    }
+    timer_heap[pos] = t;
+}
+
+// Move a timer away from the root of the heap until its children are
+// after it and store it there
+static void
+heap_sift_down(struct timer *t, uint_fast16_t pos)
+{
+    uint32_t waketime = t->waketime;
+    uint_fast16_t count = timer_heap_count;
+    for (;;) {
+        uint_fast16_t child = 2 * pos + 1;
+        if (child >= count)
+            break;
+        struct timer *c = timer_heap[child];
+        if (child + 1 < count
+            && timer_is_before(timer_heap[child + 1]->waketime, c->waketime))
+            c = timer_heap[++child];
+        if (timer_is_before(waketime, c->waketime))
+            break;
+        timer_heap[pos] = c;
+        pos = child;
+    }
+    timer_heap[pos] = t;
+}
+
+// Add a timer to the heap
+static void
+heap_insert(struct timer *t)
+{
+    if (timer_heap_count >= ARRAY_SIZE(timer_heap))
+        shutdown("Too many timers");
+    heap_sift_up(t, timer_heap_count++);
+}
+
+// Schedule a function call at a supplied time.
+void
+sched_add_timer(struct timer *add)
+{
+    uint32_t waketime = add->waketime;
+    irqstatus_t flag = irq_save();
+    if (unlikely(timer_is_before(waketime, timer_heap[0]->waketime))) {
+        // This timer is before all other scheduled timers
+        if (timer_is_before(waketime, timer_read_time()))
+            try_shutdown("Timer too close");
+        // Place deleted_timer at the root (ahead of the new timer)
+        deleted_timer.waketime = waketime;
+        if (timer_heap[0] != &deleted_timer)
+            heap_insert(&deleted_timer);
+        heap_insert(add);
+        timer_kick();
+    } else {
+        heap_insert(add);
+    }
+    irq_restore(flag);
+}
+
+// Remove a timer that may be live.
+void
+sched_del_timer(struct timer *del)
+{
+    irqstatus_t flag = irq_save();
+    if (timer_heap[0] == del) {
+        // Deleting the next active timer - replace with deleted_timer
+        deleted_timer.waketime = del->waketime;
+        timer_heap[0] = &deleted_timer;
+    } else {
+        // Find and remove from timer heap (if present)
+        uint_fast16_t pos, count = timer_heap_count;
+        for (pos = 1; pos < count; pos++) {
+            if (timer_heap[pos] != del)
+                continue;
+            struct timer *last = timer_heap[--timer_heap_count];
+            if (last == del)
+                break;
+            struct timer *parent = timer_heap[(pos - 1) / 2];
+            if (timer_is_before(last->waketime, parent->waketime))
+                heap_sift_up(last, pos);
+            else
+                heap_sift_down(last, pos);
+            break;
+        }
+    }
+    irq_restore(flag);
+}
+
+// Invoke the next timer - called from board hardware irq code.
+unsigned int
+sched_timer_dispatch(void)
+{
+    // Invoke timer callback
+    struct timer *t = timer_heap[0];
+    uint_fast8_t res;
+    if (CONFIG_INLINE_STEPPER_HACK && likely(!t->func))
+        res = stepper_event(t);
+    else
+        res = t->func(t);
+
+    // Update timer_heap (rescheduling current timer if necessary)
+    if (unlikely(res == SF_DONE))
+        heap_sift_down(timer_heap[--timer_heap_count], 0);
+    else
+        heap_sift_down(t, 0);
+
+    return timer_heap[0]->waketime;
+}
+
+// Remove all user timers
+void
+sched_timer_reset(void)
+{
+    deleted_timer.waketime = periodic_timer.waketime;
+    timer_heap[0] = &deleted_timer;
+    timer_heap[1] = &periodic_timer;
+    timer_heap_count = 2;
+    timer_kick();
+}
+
+#endif // CONFIG_SCHED_HEAP
+
 
 /****************************************************************
  * Tasks
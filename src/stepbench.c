@@ -0,0 +1,189 @@
+// Step rate benchmark commands.
+//
+// Copyright (C) 2020  Kevin O'Connor <kevin@koconnor.net>
+//
+// This file may be distributed under the terms of the GNU GPLv3 license.
+
+#include "basecmd.h" // oid_lookup
+#include "board/irq.h" // irq_disable
+#include "board/misc.h" // timer_read_time
+#include "command.h" // DECL_COMMAND
+#include "sched.h" // sched_add_timer
+#include "stepper.h" // stepper_queue_step
+
+// How often the move queues are refilled and how far ahead of the
+// current time moves are queued
+#define REFILL_TIME_US 5000
+#define LOOKAHEAD_TIME_US 20000
+
+#define BENCH_MAX_STEPPERS 8
+
+// The timer callback a benchmark stepper used before the test
+struct bench_stepper {
+    struct timer *timer;
+    uint_fast8_t (*func)(struct timer *t);
+};
+
+static struct step_benchmark {
+    struct timer refill_timer;
+    struct task_wake wake;
+    // Test parameters
+    uint8_t first_oid, stepper_count, active, reported;
+    uint16_t count, moves, queued_moves;
+    uint32_t interval, start_clock, queued_clock, end_clock;
+    // Statistics updated from the stepper timers
+    uint32_t events, event_time, max_event_time;
+    int32_t max_lateness;
+    struct bench_stepper steppers[BENCH_MAX_STEPPERS];
+} sb;
+
+// Find the saved state of a benchmark stepper
+static struct bench_stepper *
+bench_stepper_lookup(struct timer *t)
+{
+    uint8_t i;
+    for (i=0; i<sb.stepper_count; i++)
+        if (sb.steppers[i].timer == t)
+            return &sb.steppers[i];
+    shutdown("Unknown step benchmark timer");
+}
+
+// Reinstall the original timer callback of all benchmark steppers
+static void
+bench_restore_steppers(void)
+{
+    irqstatus_t flag = irq_save();
+    uint8_t i;
+    for (i=0; i<sb.stepper_count; i++) {
+        struct bench_stepper *bs = &sb.steppers[i];
+        if (bs->timer)
+            bs->timer->func = bs->func;
+        bs->timer = NULL;
+    }
+    irq_restore(flag);
+}
+
+// Timer callback wrapping the stepper's original callback that tracks
+// the timing of each step event
+static uint_fast8_t
+bench_stepper_event(struct timer *t)
+{
+    struct bench_stepper *bs = bench_stepper_lookup(t);
+    uint32_t start = timer_read_time();
+    int32_t lateness = start - t->waketime;
+    uint_fast8_t ret = bs->func ? bs->func(t) : stepper_event(t);
+    uint32_t end = timer_read_time(), event_time = end - start;
+    sb.events++;
+    sb.event_time += event_time;
+    if (event_time > sb.max_event_time)
+        sb.max_event_time = event_time;
+    if (lateness > sb.max_lateness)
+        sb.max_lateness = lateness;
+    if (ret == SF_DONE && sb.queued_moves >= sb.moves && sb.active) {
+        // This stepper completed all its moves
+        t->func = bs->func;
+        bs->timer = NULL;
+        if (!--sb.active) {
+            sb.end_clock = end;
+            sched_wake_task(&sb.wake);
+        }
+    }
+    return ret;
+}
+
+// Periodically wake the task that refills the move queues
+static uint_fast8_t
+bench_refill_event(struct timer *t)
+{
+    if (!sb.active || sb.queued_moves >= sb.moves)
+        return SF_DONE;
+    sched_wake_task(&sb.wake);
+    sb.refill_timer.waketime += timer_from_us(REFILL_TIME_US);
+    return SF_RESCHEDULE;
+}
+
+void
+command_step_benchmark(uint32_t *args)
+{
+    if (sb.active)
+        shutdown("Step benchmark already active");
+    uint8_t first_oid = args[0], stepper_count = args[1];
+    uint32_t clock = args[2], interval = args[3];
+    uint16_t count = args[4], moves = args[5];
+    if (!stepper_count || stepper_count > BENCH_MAX_STEPPERS || !interval
+        || !count || !moves)
+        shutdown("Invalid step benchmark parameters");
+    uint8_t i;
+    for (i=0; i<stepper_count; i++)
+        // The lateness of hardware timer events is not comparable
+        if (stepper_has_hw_timer(stepper_oid_lookup(first_oid + i)))
+            shutdown("Step benchmark does not support hardware timers");
+    sched_del_timer(&sb.refill_timer);
+    sb = (struct step_benchmark){
+        .first_oid = first_oid, .stepper_count = stepper_count,
+        .count = count, .moves = moves, .interval = interval,
+        .start_clock = clock, .queued_clock = clock,
+        .max_lateness = INT32_MIN,
+    };
+    // Wrap the timer callback of each stepper (stepper groups keep
+    // their own callback) and stagger the steppers so their step
+    // events do not all coincide
+    for (i=0; i<stepper_count; i++) {
+        struct stepper *s = stepper_oid_lookup(first_oid + i);
+        struct timer *t = stepper_get_timer(s);
+        irq_disable();
+        sb.steppers[i].timer = t;
+        sb.steppers[i].func = t->func;
+        t->func = bench_stepper_event;
+        irq_enable();
+        stepper_reset_step_clock(s, clock + i * interval / stepper_count);
+    }
+    sb.active = stepper_count;
+    sb.refill_timer.func = bench_refill_event;
+    sb.refill_timer.waketime = timer_read_time() + timer_from_us(
+        REFILL_TIME_US);
+    sched_add_timer(&sb.refill_timer);
+    sched_wake_task(&sb.wake);
+}
+DECL_COMMAND(command_step_benchmark,
+             "step_benchmark stepper_oid=%c stepper_count=%c clock=%u"
+             " interval=%u count=%hu moves=%hu");
+
+// Queue moves on the benchmark steppers and report the results
+void
+step_benchmark_task(void)
+{
+    if (!sched_check_wake(&sb.wake))
+        return;
+    if (!sb.stepper_count || sb.reported)
+        return;
+    uint32_t lookahead = timer_read_time() + timer_from_us(LOOKAHEAD_TIME_US);
+    while (sb.queued_moves < sb.moves
+           && timer_is_before(sb.queued_clock, lookahead)) {
+        uint8_t i;
+        for (i=0; i<sb.stepper_count; i++) {
+            struct stepper *s = stepper_oid_lookup(sb.first_oid + i);
+            stepper_queue_step(s, sb.interval, sb.count, 0);
+        }
+        sb.queued_moves++;
+        sb.queued_clock += sb.interval * sb.count;
+    }
+    if (sb.active)
+        return;
+    sb.reported = 1;
+    sendf("step_benchmark_result steps=%u start_clock=%u end_clock=%u"
+          " events=%u event_time=%u max_event_time=%u max_lateness=%i"
+          , (uint32_t)sb.stepper_count * sb.count * sb.moves
+          , sb.start_clock, sb.end_clock, sb.events, sb.event_time
+          , sb.max_event_time, sb.max_lateness);
+}
+DECL_TASK(step_benchmark_task);
+
+void
+step_benchmark_shutdown(void)
+{
+    bench_restore_steppers();
+    sb.active = 0;
+    sb.reported = 1;
+}
+DECL_SHUTDOWN(step_benchmark_shutdown);
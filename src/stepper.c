@@ -12,8 +12,14 @@
 #include "command.h" // DECL_COMMAND
 #include "sched.h" // struct timer
 #include "stepper.h" // command_config_stepper
+#if CONFIG_HAVE_STEP_TIMER
+#include "board/step_timer.h" // step_timer_add
+#endif
 
 DECL_CONSTANT("STEP_DELAY", CONFIG_STEP_DELAY);
+#if CONFIG_STEPPER_ADD2
+DECL_CONSTANT("STEPPER_ADD2", 1);
+#endif
 
 
 /****************************************************************
@@ -26,14 +32,29 @@ struct stepper_move {
     uint16_t count;
     struct stepper_move *next;
     uint8_t flags;
+#if CONFIG_STEPPER_ADD2
+    int16_t add2;
+#endif
 };
 
 enum { MF_DIR=1<<0 };
 
+// Additional pins of a stepper group (stepped along with the stepper)
+struct stepper_pins {
+    struct stepper_pins *next;
+    struct gpio_out step_pin, dir_pin;
+    uint8_t invert_step, invert_dir;
+};
+
 struct stepper {
     struct timer time;
     uint32_t interval;
+#if CONFIG_STEPPER_ADD2
+    int32_t add;
+    int16_t add2;
+#else
     int16_t add;
+#endif
 #if CONFIG_STEP_DELAY <= 0
     uint_fast16_t count;
 #define next_step_time time.waketime
@@ -44,6 +65,9 @@ struct stepper {
     struct gpio_out step_pin, dir_pin;
     uint32_t position;
     struct stepper_move *first, **plast;
+#if CONFIG_STEPPER_GROUP
+    struct stepper_pins *group;
+#endif
     uint32_t min_stop_interval;
     // gcc (pre v6) does better optimization when uint8_t are bitfields
     uint8_t flags : 8;
@@ -51,9 +75,32 @@ struct stepper {
 
 enum { POSITION_BIAS=0x40000000 };
 
+// Return the change in 'add' after each step
+static inline int32_t
+stepper_add2(struct stepper *s)
+{
+#if CONFIG_STEPPER_ADD2
+    return s->add2;
+#else
+    return 0;
+#endif
+}
+
+// Return the additional pins stepped along with a stepper
+static inline struct stepper_pins *
+stepper_group_pins(struct stepper *s)
+{
+#if CONFIG_STEPPER_GROUP
+    return s->group;
+#else
+    return NULL;
+#endif
+}
+
 enum {
     SF_LAST_DIR=1<<0, SF_NEXT_DIR=1<<1, SF_INVERT_STEP=1<<2, SF_HAVE_ADD=1<<3,
-    SF_LAST_RESET=1<<4, SF_NO_NEXT_CHECK=1<<5, SF_NEED_RESET=1<<6
+    SF_LAST_RESET=1<<4, SF_NO_NEXT_CHECK=1<<5, SF_NEED_RESET=1<<6,
+    SF_HW_TIMER=1<<7
 };
 
 // Setup a stepper for the next move in its queue
@@ -63,7 +110,10 @@ stepper_load_next(struct stepper *s, uint32_t min_next_time)
     struct stepper_move *m = s->first;
     if (!m) {
         // There is no next move - the queue is empty
-        if (s->interval - s->add < s->min_stop_interval
+        uint32_t last_interval = s->interval - s->add;
+        if (CONFIG_STEPPER_ADD2)
+            last_interval += stepper_add2(s);
+        if (last_interval < s->min_stop_interval
             && !(s->flags & SF_NO_NEXT_CHECK))
             shutdown("No next step");
         s->count = 0;
@@ -74,6 +124,10 @@ stepper_load_next(struct stepper *s, uint32_t min_next_time)
     s->next_step_time += m->interval;
     s->add = m->add;
     s->interval = m->interval + m->add;
+#if CONFIG_STEPPER_ADD2
+    s->add2 = m->add2;
+    s->add += m->add2;
+#endif
     if (CONFIG_STEP_DELAY <= 0) {
         if (CONFIG_MACH_AVR)
             // On AVR see if the add can be optimized away
@@ -97,6 +151,9 @@ stepper_load_next(struct stepper *s, uint32_t min_next_time)
     if (m->flags & MF_DIR) {
         s->position = -s->position + m->count;
         gpio_out_toggle_noirq(s->dir_pin);
+        struct stepper_pins *p;
+        for (p = stepper_group_pins(s); p; p = p->next)
+            gpio_out_toggle_noirq(p->dir_pin);
     } else {
         s->position += m->count;
     }
@@ -135,6 +192,8 @@ stepper_event_nodelay(struct stepper *s)
         s->count = count;
         s->time.waketime += s->interval;
         s->interval += s->add;
+        if (CONFIG_STEPPER_ADD2)
+            s->add += stepper_add2(s);
         gpio_out_toggle_noirq(s->step_pin);
         return SF_RESCHEDULE;
     }
@@ -164,6 +223,8 @@ stepper_event(struct timer *t)
     if (likely(s->count)) {
         s->next_step_time += s->interval;
         s->interval += s->add;
+        if (CONFIG_STEPPER_ADD2)
+            s->add += stepper_add2(s);
         if (unlikely(timer_is_before(s->next_step_time, min_next_time)))
             // The next step event is too close - push it back
             goto reschedule_min;
@@ -176,6 +237,30 @@ reschedule_min:
     return SF_RESCHEDULE;
 }
 
+#if CONFIG_STEPPER_GROUP
+// Toggle the step pins of the additional steppers in a group
+static void
+stepper_group_step(struct stepper *s)
+{
+    struct stepper_pins *p;
+    for (p = s->group; p; p = p->next)
+        gpio_out_toggle_noirq(p->step_pin);
+}
+
+// Timer callback - step the given stepper and its group
+static uint_fast8_t
+stepper_group_event(struct timer *t)
+{
+    struct stepper *s = container_of(t, struct stepper, time);
+    stepper_group_step(s);
+    uint_fast8_t ret = stepper_event(t);
+    if (CONFIG_STEP_DELAY <= 0)
+        // stepper_event() both stepped and unstepped the stepper
+        stepper_group_step(s);
+    return ret;
+}
+#endif
+
 void
 command_config_stepper(uint32_t *args)
 {
@@ -200,17 +285,86 @@ stepper_oid_lookup(uint8_t oid)
     return oid_lookup(oid, command_config_stepper);
 }
 
-// Schedule a set of steps with a given timing
+#if CONFIG_STEPPER_GROUP
+// Add a stepper driver that is stepped along with an existing stepper
 void
-command_queue_step(uint32_t *args)
+command_config_stepper_group(uint32_t *args)
 {
     struct stepper *s = stepper_oid_lookup(args[0]);
-    struct stepper_move *m = move_alloc();
-    m->interval = args[1];
-    m->count = args[2];
+    struct stepper_pins *p = alloc_chunk(sizeof(*p));
+    p->invert_step = args[3];
+    p->invert_dir = args[4];
+    p->step_pin = gpio_out_setup(args[1], p->invert_step);
+    p->dir_pin = gpio_out_setup(args[2], p->invert_dir);
+    p->next = s->group;
+    s->group = p;
+    s->time.func = stepper_group_event;
+}
+DECL_COMMAND(command_config_stepper_group,
+             "config_stepper_group oid=%c step_pin=%c dir_pin=%c"
+             " invert_step=%c invert_dir=%c");
+#endif
+
+#if CONFIG_HAVE_STEP_TIMER
+// Schedule the steps of a stepper from a dedicated hardware timer
+void
+command_config_stepper_hwtimer(uint32_t *args)
+{
+    struct stepper *s = stepper_oid_lookup(args[0]);
+    if (s->flags & SF_HW_TIMER)
+        return;
+    step_timer_setup(&s->time);
+    s->flags |= SF_HW_TIMER;
+}
+DECL_COMMAND(command_config_stepper_hwtimer, "config_stepper_hwtimer oid=%c");
+#endif
+
+// Start the stepper timer (on its hardware timer if one is assigned)
+static void
+stepper_add_timer(struct stepper *s)
+{
+#if CONFIG_HAVE_STEP_TIMER
+    if (s->flags & SF_HW_TIMER) {
+        step_timer_add(&s->time);
+        return;
+    }
+#endif
+    sched_add_timer(&s->time);
+}
+
+// Cancel the stepper timer
+static void
+stepper_del_timer(struct stepper *s)
+{
+#if CONFIG_HAVE_STEP_TIMER
+    if (s->flags & SF_HW_TIMER) {
+        step_timer_del(&s->time);
+        return;
+    }
+#endif
+    sched_del_timer(&s->time);
+}
+
+// Return the timer used to schedule the steps of a stepper
+struct timer *
+stepper_get_timer(struct stepper *s)
+{
+    return &s->time;
+}
+
+// Check if the steps of a stepper are scheduled from a hardware timer
+int
+stepper_has_hw_timer(struct stepper *s)
+{
+    return !!(s->flags & SF_HW_TIMER);
+}
+
+// Add a move to the queue of a stepper
+static void
+stepper_queue_move(struct stepper *s, struct stepper_move *m)
+{
     if (!m->count)
         shutdown("Invalid count parameter");
-    m->add = args[3];
     m->next = NULL;
     m->flags = 0;
 
@@ -238,13 +392,73 @@ command_queue_step(uint32_t *args)
         s->flags = flags;
         s->first = m;
         stepper_load_next(s, s->next_step_time + m->interval);
-        sched_add_timer(&s->time);
+        stepper_add_timer(s);
     }
     irq_enable();
 }
+
+// Schedule a set of steps with a given timing
+void
+stepper_queue_step(struct stepper *s, uint32_t interval, uint16_t count
+                   , int16_t add)
+{
+    struct stepper_move *m = move_alloc();
+    m->interval = interval;
+    m->count = count;
+    m->add = add;
+#if CONFIG_STEPPER_ADD2
+    m->add2 = 0;
+#endif
+    stepper_queue_move(s, m);
+}
+
+void
+command_queue_step(uint32_t *args)
+{
+    struct stepper *s = stepper_oid_lookup(args[0]);
+    stepper_queue_step(s, args[1], args[2], args[3]);
+}
 DECL_COMMAND(command_queue_step,
              "queue_step oid=%c interval=%u count=%hu add=%hi");
 
+#if CONFIG_STEPPER_QUEUE_STEPS
+// Schedule several sets of steps (for one or more steppers) from a
+// single command.  The data contains a series of vlq encoded
+// oid/interval/count/add tuples.
+void
+command_queue_steps(uint32_t *args)
+{
+    uint8_t *p = (void*)(size_t)args[1], *end = p + args[0];
+    while (p < end) {
+        uint8_t oid = command_parse_int(&p);
+        uint32_t interval = command_parse_int(&p);
+        uint16_t count = command_parse_int(&p);
+        int16_t add = command_parse_int(&p);
+        if (p > end)
+            shutdown("Invalid queue_steps data");
+        stepper_queue_step(stepper_oid_lookup(oid), interval, count, add);
+    }
+}
+DECL_COMMAND(command_queue_steps, "queue_steps data=%*s");
+#endif
+
+#if CONFIG_STEPPER_ADD2
+// Schedule a set of steps whose 'add' changes by 'add2' after each step
+void
+command_queue_step_add2(uint32_t *args)
+{
+    struct stepper *s = stepper_oid_lookup(args[0]);
+    struct stepper_move *m = move_alloc();
+    m->interval = args[1];
+    m->count = args[2];
+    m->add = args[3];
+    m->add2 = args[4];
+    stepper_queue_move(s, m);
+}
+DECL_COMMAND(command_queue_step_add2,
+             "queue_step_add2 oid=%c interval=%u count=%hu add=%hi add2=%hi");
+#endif
+
 // Set the direction of the next queued step
 void
 command_set_next_step_dir(uint32_t *args)
@@ -259,10 +473,8 @@ DECL_COMMAND(command_set_next_step_dir, "set_next_step_dir oid=%c dir=%c");
 
 // Set an absolute time that the next step will be relative to
 void
-command_reset_step_clock(uint32_t *args)
+stepper_reset_step_clock(struct stepper *s, uint32_t waketime)
 {
-    struct stepper *s = stepper_oid_lookup(args[0]);
-    uint32_t waketime = args[1];
     irq_disable();
     if (s->count)
         shutdown("Can't reset time when stepper active");
@@ -270,6 +482,13 @@ command_reset_step_clock(uint32_t *args)
     s->flags = (s->flags & ~SF_NEED_RESET) | SF_LAST_RESET;
     irq_enable();
 }
+
+void
+command_reset_step_clock(uint32_t *args)
+{
+    struct stepper *s = stepper_oid_lookup(args[0]);
+    stepper_reset_step_clock(s, args[1]);
+}
 DECL_COMMAND(command_reset_step_clock, "reset_step_clock oid=%c clock=%u");
 
 // Return the current stepper position.  Caller must disable irqs.
@@ -306,13 +525,18 @@ DECL_COMMAND(command_stepper_get_position, "stepper_get_position oid=%c");
 void
 stepper_stop(struct stepper *s)
 {
-    sched_del_timer(&s->time);
+    stepper_del_timer(s);
     s->next_step_time = 0;
     s->position = -stepper_get_position(s);
     s->count = 0;
-    s->flags = (s->flags & SF_INVERT_STEP) | SF_NEED_RESET;
+    s->flags = (s->flags & (SF_INVERT_STEP|SF_HW_TIMER)) | SF_NEED_RESET;
     gpio_out_write(s->dir_pin, 0);
     gpio_out_write(s->step_pin, s->flags & SF_INVERT_STEP);
+    struct stepper_pins *p;
+    for (p = stepper_group_pins(s); p; p = p->next) {
+        gpio_out_write(p->dir_pin, p->invert_dir);
+        gpio_out_write(p->step_pin, p->invert_step);
+    }
     while (s->first) {
         struct stepper_move *next = s->first->next;
         move_free(s->first);
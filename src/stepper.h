@@ -5,6 +5,11 @@
 
 uint_fast8_t stepper_event(struct timer *t);
 struct stepper *stepper_oid_lookup(uint8_t oid);
+struct timer *stepper_get_timer(struct stepper *s);
+int stepper_has_hw_timer(struct stepper *s);
+void stepper_queue_step(struct stepper *s, uint32_t interval, uint16_t count
+                        , int16_t add);
+void stepper_reset_step_clock(struct stepper *s, uint32_t waketime);
 void stepper_stop(struct stepper *s);
 
 #endif // stepper.h
@@ -0,0 +1,171 @@
+// Dedicated hardware timers for stepper step events on stm32f4
+//
+// Copyright (C) 2020  Kevin O'Connor <kevin@koconnor.net>
+//
+// This file may be distributed under the terms of the GNU GPLv3 license.
+
+#include "autoconf.h" // CONFIG_INLINE_STEPPER_HACK
+#include "board/armcm_boot.h" // armcm_enable_irq
+#include "board/irq.h" // irq_disable
+#include "board/misc.h" // timer_read_time
+#include "board/internal.h" // enable_pclock
+#include "board/step_timer.h" // step_timer_add
+#include "command.h" // shutdown
+#include "sched.h" // struct timer
+#include "stepper.h" // stepper_event
+
+// Events closer than this are run directly instead of programming the
+// hardware timer (which could otherwise miss the compare match)
+#define STEP_TIMER_MIN_TRY_TICKS timer_from_us(2)
+
+struct step_timer {
+    TIM_TypeDef *tim;
+    struct timer *timer;
+};
+
+// Both TIM2 and TIM5 have 32bit counters
+static struct step_timer step_timers[] = {
+    { .tim = TIM2 }, { .tim = TIM5 },
+};
+
+// Ratio (as a shift) of the system timer frequency to the frequency of
+// the step timers
+static uint8_t tim_freq_shift;
+
+// Determine the step timer frequency from the APB1 prescaler.  The
+// APB1 timers run at twice the APB1 clock unless APB1 is not divided.
+static void
+step_timer_init_freq(void)
+{
+    uint32_t ppre1 = (RCC->CFGR & RCC_CFGR_PPRE1_Msk) >> RCC_CFGR_PPRE1_Pos;
+    tim_freq_shift = ppre1 & 0x4 ? ppre1 & 0x3 : 0;
+}
+
+static struct step_timer *
+step_timer_lookup(struct timer *t)
+{
+    int i;
+    for (i=0; i<ARRAY_SIZE(step_timers); i++)
+        if (step_timers[i].timer == t)
+            return &step_timers[i];
+    shutdown("Unknown step timer");
+}
+
+// Program the hardware timer to fire at the given system time
+static void
+step_timer_set(TIM_TypeDef *tim, int32_t diff)
+{
+    tim->CCR1 = tim->CNT + (diff >> tim_freq_shift);
+    tim->SR = ~TIM_SR_CC1IF;
+}
+
+// Invoke the step event of the timer
+static void
+step_timer_dispatch(struct step_timer *st)
+{
+    TIM_TypeDef *tim = st->tim;
+    if (!(tim->DIER & TIM_DIER_CC1IE) || !(tim->SR & TIM_SR_CC1IF))
+        // Timer was deleted after the irq was raised
+        return;
+    struct timer *t = st->timer;
+    for (;;) {
+        uint_fast8_t res;
+        if (CONFIG_INLINE_STEPPER_HACK && likely(!t->func))
+            res = stepper_event(t);
+        else
+            res = t->func(t);
+        if (res == SF_DONE) {
+            tim->DIER = 0;
+            tim->SR = ~TIM_SR_CC1IF;
+            return;
+        }
+
+        int32_t diff = t->waketime - timer_read_time();
+        if (diff > (int32_t)STEP_TIMER_MIN_TRY_TICKS) {
+            step_timer_set(tim, diff);
+            return;
+        }
+        if (diff < (int32_t)(-timer_from_us(1000)))
+            try_shutdown("Rescheduled timer in the past");
+
+        // Next event in the past or near future - wait for it to be ready
+        irq_enable();
+        while (unlikely(diff > 0))
+            diff = t->waketime - timer_read_time();
+        irq_disable();
+    }
+}
+
+void __aligned(16)
+TIM2_IRQHandler(void)
+{
+    irq_disable();
+    step_timer_dispatch(&step_timers[0]);
+    irq_enable();
+}
+
+void __aligned(16)
+TIM5_IRQHandler(void)
+{
+    irq_disable();
+    step_timer_dispatch(&step_timers[1]);
+    irq_enable();
+}
+
+// Reserve a hardware timer for the given (stepper) timer
+void
+step_timer_setup(struct timer *t)
+{
+    int i;
+    for (i=0; i<ARRAY_SIZE(step_timers); i++) {
+        struct step_timer *st = &step_timers[i];
+        if (st->timer)
+            continue;
+        st->timer = t;
+        TIM_TypeDef *tim = st->tim;
+        irqstatus_t flag = irq_save();
+        step_timer_init_freq();
+        enable_pclock((uint32_t)tim);
+        tim->PSC = 0;
+        tim->ARR = 0xffffffff;
+        tim->CNT = 0;
+        tim->DIER = 0;
+        if (i == 0)
+            armcm_enable_irq(TIM2_IRQHandler, TIM2_IRQn, 2);
+        else
+            armcm_enable_irq(TIM5_IRQHandler, TIM5_IRQn, 2);
+        tim->CR1 = TIM_CR1_CEN;
+        irq_restore(flag);
+        return;
+    }
+    shutdown("No free step timer");
+}
+
+// Schedule the timer's event at its waketime
+void
+step_timer_add(struct timer *t)
+{
+    struct step_timer *st = step_timer_lookup(t);
+    irqstatus_t flag = irq_save();
+    int32_t diff = t->waketime - timer_read_time();
+    if (diff < (int32_t)(-timer_from_us(1000)))
+        try_shutdown("Timer too close");
+    // As with sched_add_timer(), an event slightly in the past is run
+    // as soon as possible
+    if (diff < (int32_t)STEP_TIMER_MIN_TRY_TICKS)
+        diff = STEP_TIMER_MIN_TRY_TICKS;
+    step_timer_set(st->tim, diff);
+    st->tim->DIER = TIM_DIER_CC1IE;
+    irq_restore(flag);
+}
+
+// Cancel a pending event of the timer
+void
+step_timer_del(struct timer *t)
+{
+    struct step_timer *st = step_timer_lookup(t);
+    irqstatus_t flag = irq_save();
+    st->tim->DIER = 0;
+    st->tim->SR = ~TIM_SR_CC1IF;
+    irq_restore(flag);
+}
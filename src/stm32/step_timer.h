@@ -0,0 +1,9 @@
+#ifndef __STM32_STEP_TIMER_H
+#define __STM32_STEP_TIMER_H
+
+struct timer;
+void step_timer_setup(struct timer *t);
+void step_timer_add(struct timer *t);
+void step_timer_del(struct timer *t);
+
+#endif // step_timer.h